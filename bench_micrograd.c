@@ -0,0 +1,757 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "micrograd.h"
+#include "neuralnetwork.h"
+#include "dataset.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "perfcount.h"
+
+// --- Harness ---
+//
+// every benchmark is one function run over and over. the iteration count is doubled until
+// a trial takes at least min_trial_ms (this doubles as warmup), then `warmup` more trials
+// are thrown away and `trials` trials are kept. we report the median and the p10/p90 of
+// the per-iteration wall time, measured on the monotonic clock. with --perf, the kept
+// trials of tape benchmarks also run under hardware counters, reported per tape node
+
+#define MAX_RESULTS 1024 // the matrix alone records 480
+#define MAX_TRIALS 1000
+
+typedef struct BenchResult {
+    char name[96];
+    int trials;
+    long iters; // iterations per trial
+    double median_ns; // per iteration
+    double p10_ns;
+    double p90_ns;
+    long nodes; // tape nodes per iteration (0 if not a tape benchmark)
+    double bytes; // bytes processed per iteration (0 if not a throughput benchmark)
+    // only set by the matrix: the median step split into its two halves
+    double fwd_ns;
+    double bwd_ns;
+    int batch;
+    size_t tape_bytes; // peak tape + arena bytes of one step
+    bool has_perf;
+    double perf_per_node[PERF_NEVENTS]; // < 0 where the counter is unavailable
+} BenchResult;
+
+static int trials = 11;
+static int warmup = 3;
+static double min_trial_ms = 20;
+static PerfCounters *perf = NULL; // set by --perf
+
+static BenchResult results[MAX_RESULTS];
+static int nresults = 0;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// a zeroed slot for the next result. running out is a bug in the bench list, not something
+// to truncate silently
+static BenchResult *new_result(const char *name) {
+    if (nresults == MAX_RESULTS) {
+        fprintf(stderr, "Error: more than %d benchmark results, raise MAX_RESULTS\n", MAX_RESULTS);
+        exit(1);
+    }
+    BenchResult *r = &results[nresults++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    return r;
+}
+
+static double run_trial(void (*fn)(void *ctx), void *ctx, long iters) {
+    double start = now_ns();
+    for (long i=0; i<iters; i++) fn(ctx);
+    return now_ns() - start;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    int idx = (int)(p * (n - 1) + 0.5); // nearest rank
+    return sorted[idx];
+}
+
+static BenchResult *measure(const char *name, void (*fn)(void *ctx), void *ctx, long nodes, double bytes) {
+    long iters = 1;
+    while (run_trial(fn, ctx, iters) < min_trial_ms * 1e6 && iters < (1L << 30)) {
+        iters *= 2;
+    }
+    for (int w=0; w<warmup; w++) run_trial(fn, ctx, iters);
+
+    bool counted = (perf != NULL && perf->navailable > 0 && nodes > 0);
+    if (counted) {
+        perf_reset(perf);
+        perf_begin(perf);
+    }
+    double samples[MAX_TRIALS];
+    for (int t=0; t<trials; t++) {
+        samples[t] = run_trial(fn, ctx, iters) / iters;
+    }
+    if (counted) perf_end(perf);
+    qsort(samples, trials, sizeof(double), cmp_double);
+
+    BenchResult *r = new_result(name);
+    r->trials = trials;
+    r->iters = iters;
+    r->median_ns = percentile(samples, trials, 0.5);
+    r->p10_ns = percentile(samples, trials, 0.1);
+    r->p90_ns = percentile(samples, trials, 0.9);
+    r->nodes = nodes;
+    r->bytes = bytes;
+
+    printf("%-44s %12.0f %12.0f %12.0f", r->name, r->median_ns, r->p10_ns, r->p90_ns);
+    if (nodes > 0) printf(" %9.2f ns/node", r->median_ns / nodes);
+    if (bytes > 0) printf(" %9.1f MB/s", bytes / r->median_ns * 1e3);
+    printf("\n");
+    if (counted) {
+        long total = nodes * iters * trials;
+        r->has_perf = true;
+        for (int e=0; e<PERF_NEVENTS; e++) {
+            r->perf_per_node[e] = perf_available(perf, e) ? (double)perf->value[e] / total : -1;
+        }
+        perf_report(stdout, perf, "  counters", total);
+    }
+    return r;
+}
+
+static void print_header(const char *section) {
+    printf("\n[%s]\n%-44s %12s %12s %12s\n", section, "benchmark", "median ns", "p10 ns", "p90 ns");
+}
+
+static void write_json(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    fprintf(f, "[\n");
+    for (int i=0; i<nresults; i++) {
+        BenchResult *r = &results[i];
+        fprintf(f, "  {\"name\": \"%s\", \"trials\": %d, \"iters\": %ld, \"median_ns\": %.1f, \"p10_ns\": %.1f, "
+                   "\"p90_ns\": %.1f, \"nodes\": %ld, \"ns_per_node\": %.3f, \"bytes\": %.0f, "
+                   "\"fwd_ns\": %.1f, \"bwd_ns\": %.1f, \"batch\": %d, \"tape_bytes\": %zu",
+                r->name, r->trials, r->iters, r->median_ns, r->p10_ns, r->p90_ns, r->nodes,
+                r->nodes ? r->median_ns / r->nodes : 0.0, r->bytes, r->fwd_ns, r->bwd_ns, r->batch,
+                r->tape_bytes);
+        if (r->has_perf) {
+            for (int e=0; e<PERF_NEVENTS; e++) {
+                if (r->perf_per_node[e] < 0) fprintf(f, ", \"%s_per_node\": null", perf_event_names[e]);
+                else fprintf(f, ", \"%s_per_node\": %.3f", perf_event_names[e], r->perf_per_node[e]);
+            }
+        }
+        fprintf(f, "}%s\n", (i == nresults-1) ? "" : ",");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+}
+
+static void write_csv(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+    fprintf(f, "name,trials,iters,median_ns,p10_ns,p90_ns,nodes,ns_per_node,bytes,fwd_ns,bwd_ns,batch,tape_bytes\n");
+    for (int i=0; i<nresults; i++) {
+        BenchResult *r = &results[i];
+        fprintf(f, "%s,%d,%ld,%.1f,%.1f,%.1f,%ld,%.3f,%.0f,%.1f,%.1f,%d,%zu\n", r->name, r->trials, r->iters,
+                r->median_ns, r->p10_ns, r->p90_ns, r->nodes, r->nodes ? r->median_ns / r->nodes : 0.0, r->bytes,
+                r->fwd_ns, r->bwd_ns, r->batch, r->tape_bytes);
+    }
+    fclose(f);
+}
+
+// --- Benchmarks ---
+
+typedef struct TrainStep {
+    MLP *mlp;
+    Value **x;
+    float *data;
+    int input_dim;
+} TrainStep;
+
+static void train_step(void *ctx) {
+    TrainStep *t = ctx;
+    // Bind fresh inputs every step (simulating real training)
+    bind_inputs(t->x, t->data, t->input_dim);
+    Value **out = forward(t->mlp, t->x);
+    zero_grad();
+    backward(out[0], false); // Linear sweep
+}
+
+void bench_model(int input_dim, int hidden_dim, const char *label) {
+    int layerdims[] = {hidden_dim, hidden_dim, 10};
+    TrainStep t;
+    t.mlp = new_mlp(input_dim, 3, layerdims, NULL);
+    t.x = new_inputs(input_dim, false);
+    t.data = malloc(input_dim * sizeof(float));
+    for (int i=0; i<input_dim; i++) t.data[i] = 0.1f;
+    t.input_dim = input_dim;
+
+    forward(t.mlp, t.x);
+    long nodes = tape_size();
+    free_vals();
+
+    char name[96];
+    snprintf(name, sizeof(name), "train_step/%s/in%d_h%d", label, input_dim, hidden_dim);
+    measure(name, train_step, &t, nodes, 0);
+
+    free(t.data);
+    free_inputs(t.x);
+    free_mlp(t.mlp);
+}
+
+typedef struct Sweep {
+    Value *loss;
+    void (*backward_fn)(Value *root, bool retain_graph);
+} Sweep;
+
+static void sweep(void *ctx) {
+    Sweep *s = ctx;
+    zero_grad();
+    s->backward_fn(s->loss, true); // retain_graph=true to reuse data
+}
+
+// linear sweep vs DFS, on a tape full of noise (case 1) and on a fully live tape (case 2)
+void bench_algorithms() {
+    // CASE 1: 10,000 garbage nodes disconnected from the loss, then 500 live ones
+    for (int i=0; i<10000; i++) {
+        Value *a = new_val(i, NULL, NULL);
+        Value *b = new_val(i, NULL, NULL);
+        mul(a, b);
+    }
+    Value *head = new_val(1.0, NULL, NULL);
+    for (int i=0; i<500; i++) {
+        head = add(head, new_val(0.5, NULL, NULL));
+    }
+    Sweep s = {head, backward};
+    measure("backward/disjoint/linear", sweep, &s, tape_size(), 0);
+    s.backward_fn = backward_dfs;
+    measure("backward/disjoint/dfs", sweep, &s, tape_size(), 0);
+
+    // compact once, then every sweep is linear over the live nodes only
+    double start = now_ns();
+    s.loss = tape_compact(head);
+    double compact_ns = now_ns() - start;
+    s.backward_fn = backward;
+    measure("backward/disjoint/compacted_linear", sweep, &s, tape_size(), 0);
+    printf("%-44s one-off tape_compact %.0f ns\n", "", compact_ns);
+    free_vals();
+
+    // CASE 2: one 5000 node chain, every node on the tape is live
+    head = new_val(1.0, NULL, NULL);
+    for (int i=0; i<5000; i++) {
+        head = add(head, new_val(0.5, NULL, NULL));
+    }
+    s.loss = head;
+    s.backward_fn = backward;
+    measure("backward/connected/linear", sweep, &s, tape_size(), 0);
+    s.backward_fn = backward_dfs;
+    measure("backward/connected/dfs", sweep, &s, tape_size(), 0);
+    free_vals();
+}
+
+typedef struct DeepStep {
+    MLP *mlp;
+    Value **x;
+    int segment_layers; // < 0: plain forward
+} DeepStep;
+
+static void deep_step(void *ctx) {
+    DeepStep *d = ctx;
+    Value **out = (d->segment_layers < 0) ? forward(d->mlp, d->x) : forward_checkpointed(d->mlp, d->x, d->segment_layers);
+    zero_grad();
+    backward(out[0], false);
+}
+
+// plain forward vs gradient checkpointing on a deep, narrow net: step time against peak tape
+void bench_grad_checkpointing(int depth, int width) {
+    int layerdims[depth];
+    for (int i=0; i<depth; i++) layerdims[i] = (i == depth-1) ? 1 : width;
+    DeepStep d = {new_mlp(width, depth, layerdims, NULL), new_inputs(width, false), -1};
+
+    int segments[] = {-1, 0, 2, depth / 2};
+    for (int i=0; i<4; i++) {
+        d.segment_layers = segments[i];
+        mg_reset_peak();
+        deep_step(&d);
+        size_t peak = mg_memstats().peak_tape_bytes;
+
+        char name[96];
+        if (segments[i] < 0) snprintf(name, sizeof(name), "deep_step/d%d_w%d/plain", depth, width);
+        else if (segments[i] == 0) snprintf(name, sizeof(name), "deep_step/d%d_w%d/segments_sqrt", depth, width);
+        else snprintf(name, sizeof(name), "deep_step/d%d_w%d/segments_%d", depth, width, segments[i]);
+        BenchResult *r = measure(name, deep_step, &d, 0, 0);
+        r->tape_bytes = peak;
+        printf("%-44s peak tape %.1f KB\n", "", peak / 1024.0);
+    }
+
+    free_inputs(d.x);
+    free_mlp(d.mlp);
+}
+
+static void bench_thread_scaling(const char *label, Value *loss) {
+    for (int threads=1; threads<=4; threads*=2) {
+        set_backward_threads(threads);
+        Sweep s = {loss, backward_parallel};
+        char name[96];
+        snprintf(name, sizeof(name), "backward_parallel/%s/t%d", label, threads);
+        measure(name, sweep, &s, tape_size(), 0);
+    }
+    set_backward_threads(1);
+}
+
+// backward_parallel at 1/2/4 threads, on a batch through wide fused layers (levels split
+// by rows) and on a wide tree of scalar ops (levels split by nodes). with 1 thread it is
+// the plain serial backward, so that line is the baseline
+void bench_parallel_backward(int width, int batch, int nscalar) {
+    printf("%-44s %ld hardware threads\n", "", sysconf(_SC_NPROCESSORS_ONLN));
+    int layerdims[] = {width, width, 1};
+    MLP *mlp = new_mlp(width, 3, layerdims, NULL);
+    Value **x = new_inputs(width, false);
+    Value *loss = new_const(0);
+    for (int s=0; s<batch; s++) {
+        loss = add(loss, v_pow(forward(mlp, x)[0], 2));
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "dense_w%d_b%d", width, batch);
+    bench_thread_scaling(label, loss);
+    free_vals();
+
+    Value **terms = malloc(nscalar * sizeof(Value*));
+    for (int i=0; i<nscalar; i++) {
+        terms[i] = v_tanh(mul_scalar(new_param(random_uniform(-1, 1)), 0.5f));
+    }
+    for (int n=nscalar; n>1; n/=2) {
+        for (int i=0; i<n/2; i++) terms[i] = add(terms[2*i], terms[2*i+1]);
+    }
+    snprintf(label, sizeof(label), "scalar_tree_%d", nscalar);
+    bench_thread_scaling(label, terms[0]);
+
+    free(terms);
+    free_inputs(x);
+    free_mlp(mlp); // also frees the tree's params
+}
+
+typedef struct SampleStep {
+    MLP *mlp;
+    Value **x;
+    int batch;
+    bool per_sample; // backward_samples, or else backward_parallel
+} SampleStep;
+
+// one minibatch step shaped like demo_xor: a running sum of per-sample losses
+static void sample_step(void *ctx) {
+    SampleStep *t = ctx;
+    TapeMark starts[t->batch];
+    Value *losses[t->batch];
+    Value *total = new_val(0, NULL, NULL);
+    for (int s=0; s<t->batch; s++) {
+        starts[s] = tape_mark();
+        losses[s] = v_pow(forward(t->mlp, t->x)[0], 2);
+        total = add(total, losses[s]);
+    }
+    zero_grad();
+    if (t->per_sample) backward_samples(total, starts, losses, t->batch, false);
+    else backward_parallel(total, false);
+}
+
+// per-sample backward against the wavefront one on the same minibatch step. the levels
+// of a batch are narrow (the samples hang off a sum chain at different depths), while
+// the samples themselves are independent
+void bench_per_sample_backward(int width, int batch) {
+    int layerdims[] = {width, width, 1};
+    SampleStep t = {new_mlp(width, 3, layerdims, NULL), new_inputs(width, false), batch, false};
+    for (int threads=1; threads<=4; threads*=2) {
+        set_backward_threads(threads);
+        for (int per_sample=0; per_sample<2; per_sample++) {
+            t.per_sample = per_sample;
+            char name[96];
+            snprintf(name, sizeof(name), "train_step/w%d_b%d/%s/t%d", width, batch, per_sample ? "per_sample" : "wavefront", threads);
+            measure(name, sample_step, &t, 0, 0);
+        }
+    }
+    set_backward_threads(1);
+    free_inputs(t.x);
+    free_mlp(t.mlp);
+}
+
+// buffered vs atomic param grads in the per-sample backward. a tiny model puts every
+// thread on the same handful of params (high contention, and almost nothing to reduce),
+// a wide one spreads them over thousands (low contention, a big reduction)
+void bench_param_grad_contention(int batch) {
+    int widths[] = {4, 64};
+    const char *modes[] = {"buffered", "atomic"};
+    for (int w=0; w<2; w++) {
+        int layerdims[] = {widths[w], widths[w], 1};
+        SampleStep t = {new_mlp(widths[w], 3, layerdims, NULL), new_inputs(widths[w], false), batch, true};
+        long params = mg_memstats().params;
+        for (int threads=2; threads<=4; threads*=2) {
+            set_backward_threads(threads);
+            for (int m=0; m<2; m++) {
+                set_param_grad_mode(m == 0 ? PARAM_GRAD_BUFFERED : PARAM_GRAD_ATOMIC);
+                char name[96];
+                snprintf(name, sizeof(name), "param_grads/%ld_params_b%d/%s/t%d", params, batch, modes[m], threads);
+                measure(name, sample_step, &t, 0, 0);
+            }
+        }
+        set_param_grad_mode(PARAM_GRAD_BUFFERED);
+        set_backward_threads(1);
+        free_inputs(t.x);
+        free_mlp(t.mlp);
+    }
+}
+
+typedef struct Normalize {
+    Value **x;
+    int n;
+} Normalize;
+
+// a normalization written the way user code tends to: (x - mean) is spelled out twice
+static void normalize_step(void *ctx) {
+    Normalize *t = ctx;
+    Value *sum = new_const(0);
+    for (int i=0; i<t->n; i++) sum = add(sum, t->x[i]);
+    Value *mean = mul_scalar(sum, 1.0f / t->n);
+    Value *var = new_const(0);
+    for (int i=0; i<t->n; i++) var = add(var, v_pow(sub(t->x[i], mean), 2));
+    Value *inv_std = v_pow(add_scalar(mul_scalar(var, 1.0f / t->n), 1e-5f), -0.5f);
+    Value *loss = new_const(0);
+    for (int i=0; i<t->n; i++) loss = add(loss, v_tanh(mul(sub(t->x[i], mean), inv_std)));
+    backward(loss, false);
+}
+
+void bench_cse(int n) {
+    Normalize t = {new_inputs(n, true), n};
+    for (int i=0; i<n; i++) t.x[i]->data = random_uniform(-1, 1);
+
+    for (int on=0; on<2; on++) {
+        cse_enable(on);
+        cse_reset_stats();
+        char name[96];
+        snprintf(name, sizeof(name), "normalize/n%d/cse_%s", n, on ? "on" : "off");
+        measure(name, normalize_step, &t, 0, 0);
+        if (on) printf("%-44s hit rate %.1f%%\n", "", 100 * cse_stats().hit_rate);
+    }
+    cse_enable(false);
+    free_inputs(t.x);
+}
+
+typedef struct CsvConvert {
+    const char *csv;
+    const char *bin;
+} CsvConvert;
+
+static void csv_convert(void *ctx) {
+    CsvConvert *c = ctx;
+    dataset_from_csv(c->csv, c->bin, 1);
+}
+
+void bench_csv(int nrows, int ncols) {
+    CsvConvert c = {"bench_dataset.csv", "bench_dataset.bin"};
+    FILE *f = fopen(c.csv, "w");
+    for (int i=0; i<nrows; i++) {
+        for (int j=0; j<ncols; j++) {
+            fprintf(f, "%s%.6f", j ? "," : "", random_uniform(-100, 100));
+        }
+        fputc('\n', f);
+    }
+    long bytes = ftell(f);
+    fclose(f);
+
+    char name[96];
+    snprintf(name, sizeof(name), "csv_to_dataset/%dx%d", nrows, ncols);
+    measure(name, csv_convert, &c, 0, bytes);
+
+    remove(c.csv);
+    remove(c.bin);
+}
+
+typedef struct ColdStart {
+    const char *path;
+    int input_dim;
+} ColdStart;
+
+static void cold_start(void *ctx) {
+    ColdStart *c = ctx;
+    float x[c->input_dim], y[10];
+    memset(x, 0, sizeof(x));
+    MLP *mapped = mlp_load_mapped(c->path);
+    mlp_predict(mapped, x, y);
+    free_mlp(mapped);
+}
+
+void bench_checkpoint(int input_dim, int hidden_dim) {
+    ColdStart c = {"bench_model.ckpt", input_dim};
+    int layerdims[] = {hidden_dim, hidden_dim, 10};
+    MLP *mlp = new_mlp(input_dim, 3, layerdims, NULL);
+    mlp_save(mlp, c.path);
+    free_mlp(mlp);
+
+    char name[96];
+    snprintf(name, sizeof(name), "checkpoint_cold_start/in%d_h%d", input_dim, hidden_dim);
+    measure(name, cold_start, &c, 0, 0);
+    remove(c.path);
+}
+
+// --- Matrix ---
+//
+// one training step (forward over a minibatch, summed squared-error loss, backward) for
+// every combination of width, depth, batch size, layer path and backward strategy. forward
+// and backward are timed separately within each step. every sample's start is marked, so
+// the "samples" strategy (backward_samples) runs on exactly the tape the others sweep
+
+typedef enum { PATH_FUSED, PATH_UNFUSED } LayerPath;
+static const char *path_names[] = {"fused", "unfused"};
+
+typedef struct Strategy {
+    const char *name;
+    void (*backward_fn)(Value *root, bool retain_graph); // NULL: backward_samples, per batch sample
+    bool threaded; // runs with set_backward_threads(bench_threads)
+} Strategy;
+
+static int bench_threads = 4; // --threads
+
+static Strategy strategies[] = {
+    {"linear", backward, false},
+    {"parallel", backward_parallel, true},
+    {"samples", NULL, true},
+    {"dfs", backward_dfs, false},
+};
+#define NSTRATEGIES (int)(sizeof(strategies) / sizeof(strategies[0]))
+
+typedef struct MatrixStep {
+    MLP *mlp;
+    Value ***x; // batch sets of input placeholders (the tape references them until backward)
+    int batch;
+    LayerPath path;
+    Strategy *strategy;
+    double fwd_ns; // accumulated over the current trial
+    double bwd_ns;
+    long nodes; // recorded by the last step
+    size_t tape_bytes;
+} MatrixStep;
+
+static Value **forward_path(MLP *mlp, Value **x, LayerPath path) {
+    for (int i=0; i<mlp->nlayers; i++) {
+        x = (path == PATH_FUSED) ? layer_forward(mlp->layers[i], x) : layer_forward_unfused(mlp->layers[i], x);
+    }
+    return x;
+}
+
+static void matrix_step(void *ctx) {
+    MatrixStep *m = ctx;
+    double t0 = now_ns();
+    TapeMark starts[m->batch];
+    Value *losses[m->batch];
+    Value *loss = new_val(0, NULL, NULL);
+    for (int b=0; b<m->batch; b++) {
+        starts[b] = tape_mark();
+        Value **out = forward_path(m->mlp, m->x[b], m->path);
+        losses[b] = v_pow(add_scalar(out[0], -0.5f), 2);
+        loss = add(loss, losses[b]);
+    }
+    m->nodes = tape_size();
+    m->tape_bytes = tape_bytes();
+    double t1 = now_ns();
+    zero_grad();
+    if (m->strategy->backward_fn != NULL) m->strategy->backward_fn(loss, false);
+    else backward_samples(loss, starts, losses, m->batch, false);
+    double t2 = now_ns();
+    m->fwd_ns += t1 - t0;
+    m->bwd_ns += t2 - t1;
+}
+
+// rough upper bounds on what one step records, to skip configurations that can't fit
+static long matrix_nodes(int width, int depth, int batch, LayerPath path) {
+    long per_layer = (path == PATH_FUSED) ? width : (long)width * (2 * width + 2);
+    return batch * (depth * per_layer + 4) + 1;
+}
+
+static long matrix_arena_words(int width, int depth, int batch, LayerPath path) {
+    return (path == PATH_FUSED) ? (long)batch * depth * (width + 8) : 0;
+}
+
+static void matrix_run(int width, int depth, int batch, LayerPath path, Strategy *strategy) {
+    int layerdims[depth];
+    for (int i=0; i<depth-1; i++) layerdims[i] = width;
+    layerdims[depth-1] = 1;
+
+    set_backward_threads(strategy->threaded ? bench_threads : 1);
+    MatrixStep m;
+    m.mlp = new_mlp(width, depth, layerdims, NULL);
+    m.batch = batch;
+    m.path = path;
+    m.strategy = strategy;
+    m.x = malloc(batch * sizeof(Value**));
+    float data[width];
+    for (int i=0; i<width; i++) data[i] = random_uniform(-1, 1);
+    for (int b=0; b<batch; b++) {
+        m.x[b] = new_inputs(width, false);
+        bind_inputs(m.x[b], data, width);
+    }
+
+    // calibrate (and warm up) like measure() does
+    long iters = 1;
+    while (run_trial(matrix_step, &m, iters) < min_trial_ms * 1e6 && iters < (1L << 30)) {
+        iters *= 2;
+    }
+    for (int w=0; w<warmup; w++) run_trial(matrix_step, &m, iters);
+
+    double step[MAX_TRIALS], fwd[MAX_TRIALS], bwd[MAX_TRIALS];
+    for (int t=0; t<trials; t++) {
+        m.fwd_ns = m.bwd_ns = 0;
+        step[t] = run_trial(matrix_step, &m, iters) / iters;
+        fwd[t] = m.fwd_ns / iters;
+        bwd[t] = m.bwd_ns / iters;
+    }
+    qsort(step, trials, sizeof(double), cmp_double);
+    qsort(fwd, trials, sizeof(double), cmp_double);
+    qsort(bwd, trials, sizeof(double), cmp_double);
+
+    long nodes = m.nodes;
+    char name[96];
+    snprintf(name, sizeof(name), "matrix/w%d_d%d_b%d/%s/%s", width, depth, batch, path_names[path], strategy->name);
+    BenchResult *r = new_result(name);
+    r->trials = trials;
+    r->iters = iters;
+    r->median_ns = percentile(step, trials, 0.5);
+    r->p10_ns = percentile(step, trials, 0.1);
+    r->p90_ns = percentile(step, trials, 0.9);
+    r->nodes = nodes;
+    r->fwd_ns = percentile(fwd, trials, 0.5);
+    r->bwd_ns = percentile(bwd, trials, 0.5);
+    r->batch = batch;
+    r->tape_bytes = m.tape_bytes;
+
+    printf("%6d %6d %6d %8s %8s %12.1f %12.1f %12.0f %12.0f %10ld %10.1f\n", width, depth, batch,
+           path_names[path], strategy->name, r->fwd_ns / 1e3, r->bwd_ns / 1e3,
+           batch / r->fwd_ns * 1e9, batch / r->bwd_ns * 1e9, nodes, r->tape_bytes / 1024.0);
+
+    for (int b=0; b<batch; b++) free_inputs(m.x[b]);
+    free(m.x);
+    free_mlp(m.mlp);
+    set_backward_threads(1);
+}
+
+void bench_matrix() {
+    int widths[] = {4, 16, 64, 256, 1024};
+    int depths[] = {1, 2, 4, 8};
+    int batches[] = {1, 8, 32};
+
+    printf("\n[Matrix] (parallel: %d threads, %ld hardware threads)\n%6s %6s %6s %8s %8s %12s %12s %12s %12s %10s %10s\n",
+           bench_threads, sysconf(_SC_NPROCESSORS_ONLN), "width", "depth", "batch", "layers",
+           "bwd", "fwd us", "bwd us", "fwd smp/s", "bwd smp/s", "nodes", "tape KB");
+    for (int wi=0; wi<5; wi++)
+    for (int di=0; di<4; di++)
+    for (int bi=0; bi<3; bi++)
+    for (int p=PATH_FUSED; p<=PATH_UNFUSED; p++)
+    for (int si=0; si<NSTRATEGIES; si++) {
+        int w = widths[wi], d = depths[di], b = batches[bi];
+        if (matrix_nodes(w, d, b, p) > MAX_TAPE_SIZE || matrix_arena_words(w, d, b, p) > MAX_ARENA_WORDS) {
+            printf("%6d %6d %6d %8s %8s %12s\n", w, d, b, path_names[p], strategies[si].name, "(exceeds tape)");
+            continue;
+        }
+        matrix_run(w, d, b, p, &strategies[si]);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--matrix] [--json FILE] [--csv FILE] [--trials N] [--warmup N] [--min-trial-ms MS] [--profile FILE] [--trace FILE] [--perf] [--threads N]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *json_path = NULL, *csv_path = NULL, *profile_path = NULL, *trace_path = NULL;
+    bool matrix = false;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--matrix") == 0) {
+            matrix = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = perf_open();
+            continue;
+        }
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "--json") == 0) json_path = argv[++i];
+        else if (strcmp(argv[i], "--csv") == 0) csv_path = argv[++i];
+        else if (strcmp(argv[i], "--trials") == 0) trials = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warmup") == 0) warmup = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--min-trial-ms") == 0) min_trial_ms = atof(argv[++i]);
+        else if (strcmp(argv[i], "--profile") == 0) profile_path = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0) trace_path = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0) bench_threads = atoi(argv[++i]);
+        else usage(argv[0]);
+    }
+    if (trials < 1 || trials > MAX_TRIALS || bench_threads < 1) usage(argv[0]);
+    srand(1234); // same weights every run, so runs are comparable
+    if (trace_path) {
+        trace_thread_name("bench");
+        trace_start(); // only the last TRACE_RING_EVENTS events are kept
+    }
+
+    printf("=== MICROGRAD C BENCHMARKS (%d trials, %d warmup, >= %.0f ms per trial) ===\n", trials, warmup, min_trial_ms);
+    if (perf && perf->navailable == 0) perf_report(stdout, perf, "--perf", 0); // says why, then carry on without
+
+    if (matrix) {
+        bench_matrix();
+    } else {
+        print_header("Training Step");
+        bench_model(2, 4, "small");
+        bench_model(64, 128, "large");
+
+        print_header("Backward: Linear Sweep vs DFS");
+        bench_algorithms();
+
+        print_header("Gradient Checkpointing");
+        bench_grad_checkpointing(16, 64);
+
+        print_header("Parallel Backward (thread scaling)");
+        bench_parallel_backward(256, 8, 1 << 14);
+        bench_per_sample_backward(64, 32);
+
+        print_header("Param Grad Accumulation (contention)");
+        bench_param_grad_contention(64);
+
+        print_header("Common-Subexpression Elimination");
+        bench_cse(1000);
+
+        print_header("I/O");
+        bench_csv(200000, 8);
+        bench_checkpoint(64, 128);
+    }
+
+    if (json_path) write_json(json_path);
+    if (csv_path) write_csv(csv_path);
+    if (perf) perf_close(perf);
+    if (trace_path) {
+        trace_stop();
+        if (trace_export(trace_path) != 0) return 1;
+    }
+#ifdef MICROGRAD_PROFILE
+    print_header("Per-op Profile (all runs above)");
+    profile_report(stdout);
+#endif
+    if (profile_path) {
+        FILE *f = fopen(profile_path, "w");
+        if (f == NULL) {
+            perror(profile_path);
+            return 1;
+        }
+        profile_report_json(f);
+        fclose(f);
+    }
+    return 0;
+}
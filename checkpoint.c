@@ -0,0 +1,336 @@
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "trace.h"
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// UINT64_MAX if the count doesn't fit, which never matches a real file
+static uint64_t blob_floats(uint32_t inputdim, uint32_t nlayers, const int *dims) {
+    uint64_t n = 0;
+    for (uint32_t i=0; i<nlayers; i++) {
+        uint64_t nin = (i == 0) ? inputdim : (uint64_t)dims[i-1];
+        uint64_t layer = (uint64_t)dims[i] * nin + dims[i]; // both are < 2^31, no overflow
+        if (layer > UINT64_MAX - n) return UINT64_MAX;
+        n += layer;
+    }
+    return n;
+}
+
+static uint64_t blob_offset(uint32_t nlayers) {
+    uint64_t end = sizeof(CheckpointHeader) + (uint64_t)nlayers * sizeof(CheckpointLayer);
+    return (end + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+uint64_t mlp_nfloats(MLP *mlp) {
+    uint64_t n = 0;
+    for (int i=0; i<mlp->nlayers; i++) {
+        n += (uint64_t)mlp->layers[i]->nout * mlp->layers[i]->nin + mlp->layers[i]->nout;
+    }
+    return n;
+}
+
+// copies every parameter into blob (mlp_nfloats floats) in checkpoint order
+void mlp_gather_params(MLP *mlp, float *blob) {
+    if (mlp->blob != NULL) {
+        memcpy(blob, mlp->blob, mlp_nfloats(mlp) * sizeof(float));
+        return;
+    }
+    for (int i=0; i<mlp->nlayers; i++) {
+        Layer *l = mlp->layers[i];
+        for (int k=0; k<l->nout * l->nin; k++) *blob++ = l->weights[k]->data;
+        for (int j=0; j<l->nout; j++) *blob++ = l->biases[j]->data;
+    }
+}
+
+// with durable set, the file is written next to `path`, fsync'd and renamed over it, so a
+// crash leaves either the old checkpoint or the new one, never half of one
+static int write_checkpoint(const char *path, MLP *mlp, const float *blob, bool durable) {
+    char tmp_path[strlen(path) + 5];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    const char *out_path = durable ? tmp_path : path;
+
+    FILE *f = fopen(out_path, "wb");
+    if (f == NULL) {
+        perror(out_path);
+        return -1;
+    }
+
+    CheckpointHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, 4);
+    h.version = CHECKPOINT_VERSION;
+    h.inputdim = mlp->layers[0]->nin;
+    h.nlayers = mlp->nlayers;
+    h.blob_offset = blob_offset(mlp->nlayers);
+    h.nfloats = mlp_nfloats(mlp);
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (int i=0; i<mlp->nlayers; i++) {
+        CheckpointLayer cl = { mlp->layers[i]->nout, mlp->layers[i]->activation };
+        fwrite(&cl, sizeof(cl), 1, f);
+    }
+    char pad[CHECKPOINT_ALIGN] = {0};
+    fwrite(pad, 1, h.blob_offset - ftell(f), f);
+    fwrite(blob, sizeof(float), h.nfloats, f);
+
+    int err = ferror(f) || fflush(f) != 0;
+    if (durable && !err) err = fsync(fileno(f)) != 0;
+    if (fclose(f) != 0 || err) {
+        perror(out_path);
+        return -1;
+    }
+
+    if (durable) {
+        if (rename(tmp_path, path) != 0) {
+            perror(path);
+            return -1;
+        }
+        // make the rename itself durable too
+        char dir[strlen(path) + 1];
+        strcpy(dir, path);
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) strcpy(dir, ".");
+        else if (slash == dir) slash[1] = '\0';
+        else *slash = '\0';
+        int dfd = open(dir, O_RDONLY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+    return 0;
+}
+
+// returns 0 on success, -1 (with a message on stderr) on failure
+int mlp_save(MLP *mlp, const char *path) {
+    float *blob = malloc(mlp_nfloats(mlp) * sizeof(float));
+    mlp_gather_params(mlp, blob);
+    int ret = write_checkpoint(path, mlp, blob, false);
+    free(blob);
+    return ret;
+}
+
+// maps the checkpoint and checks it. on success fills *dims/*acts (caller frees) and returns the mapping
+static const CheckpointHeader *map_checkpoint(const char *path, size_t *size, int **dims, Activation **acts) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+        fprintf(stderr, "Error: %s is not a checkpoint\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (map == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    const CheckpointHeader *h = map;
+    const CheckpointLayer *cl = (const CheckpointLayer *)(h + 1);
+    if (memcmp(h->magic, CHECKPOINT_MAGIC, 4) != 0 || h->version != CHECKPOINT_VERSION || h->nlayers == 0
+        || h->nlayers > INT_MAX || (uint64_t)st.st_size < blob_offset(h->nlayers)) {
+        fprintf(stderr, "Error: %s is not a version %d checkpoint\n", path, CHECKPOINT_VERSION);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    // the layer table is in the file (checked above), so these are at most file-sized
+    *dims = malloc(h->nlayers * sizeof(int));
+    *acts = malloc(h->nlayers * sizeof(Activation));
+    if (*dims == NULL || *acts == NULL) {
+        perror(path);
+        free(*dims);
+        free(*acts);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    bool shapes_ok = h->inputdim >= 1 && h->inputdim <= INT_MAX;
+    for (uint32_t i=0; i<h->nlayers; i++) {
+        shapes_ok &= cl[i].nout >= 1 && cl[i].nout <= INT_MAX && cl[i].activation <= ACT_GELU;
+        (*dims)[i] = (int)cl[i].nout;
+        (*acts)[i] = (Activation)cl[i].activation;
+    }
+    uint64_t blob_bytes = (uint64_t)st.st_size - blob_offset(h->nlayers);
+    if (!shapes_ok || h->blob_offset != blob_offset(h->nlayers)
+        || h->nfloats != blob_floats(h->inputdim, h->nlayers, *dims)
+        || blob_bytes % sizeof(float) != 0 || h->nfloats != blob_bytes / sizeof(float)) {
+        fprintf(stderr, "Error: %s is truncated or inconsistent\n", path);
+        free(*dims);
+        free(*acts);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return h;
+}
+
+// a fully trainable copy: fresh Value params, initialized from the checkpoint
+MLP *mlp_load(const char *path) {
+    size_t size;
+    int *dims;
+    Activation *acts;
+    const CheckpointHeader *h = map_checkpoint(path, &size, &dims, &acts);
+    if (h == NULL) return NULL;
+
+    MLP *mlp = new_mlp(h->inputdim, h->nlayers, dims, acts);
+    const float *p = (const float *)((const char *)h + h->blob_offset);
+    for (int i=0; i<mlp->nlayers; i++) {
+        Layer *l = mlp->layers[i];
+        for (int k=0; k<l->nout * l->nin; k++) l->weights[k]->data = *p++;
+        for (int j=0; j<l->nout; j++) l->biases[j]->data = *p++;
+    }
+
+    free(dims);
+    free(acts);
+    munmap((void *)h, size);
+    return mlp;
+}
+
+// inference only: the blob stays in the page cache and is used as the parameter storage
+// directly, nothing is read or copied up front. run it with mlp_predict
+MLP *mlp_load_mapped(const char *path) {
+    size_t size;
+    int *dims;
+    Activation *acts;
+    const CheckpointHeader *h = map_checkpoint(path, &size, &dims, &acts);
+    if (h == NULL) return NULL;
+
+    MLP *mlp = malloc(sizeof(MLP));
+    Layer **layers = malloc(h->nlayers * sizeof(Layer*));
+    Layer *shapes = calloc(h->nlayers, sizeof(Layer)); // shape only, no neurons or Value params
+    if (mlp == NULL || layers == NULL || shapes == NULL) {
+        perror(path);
+        free(mlp);
+        free(layers);
+        free(shapes);
+        free(dims);
+        free(acts);
+        munmap((void *)h, size);
+        return NULL;
+    }
+    mlp->nlayers = h->nlayers;
+    mlp->layers = layers;
+    for (int i=0; i<mlp->nlayers; i++) {
+        Layer *l = &shapes[i];
+        l->nin = (i == 0) ? (int)h->inputdim : dims[i-1];
+        l->nout = dims[i];
+        l->activation = acts[i];
+        mlp->layers[i] = l;
+    }
+    mlp->blob = (const float *)((const char *)h + h->blob_offset);
+    mlp->map = (void *)h;
+    mlp->map_size = size;
+
+    free(dims);
+    free(acts);
+    return mlp;
+}
+
+static void *checkpoint_thread(void *arg) {
+    AsyncCheckpointer *c = arg;
+    trace_thread_name("checkpoint");
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (!c->pending && !c->stop) {
+            pthread_cond_wait(&c->wake, &c->lock);
+        }
+        if (!c->pending) break; // stopping, and nothing left to write
+        pthread_mutex_unlock(&c->lock);
+
+        // the staging blob is ours until pending is cleared, training carries on meanwhile
+        TRACE_BEGIN("checkpoint_write");
+        int ret = write_checkpoint(c->path, c->mlp, c->staging, true);
+        TRACE_END("checkpoint_write");
+
+        pthread_mutex_lock(&c->lock);
+        c->pending = false;
+        if (ret == 0) c->written++;
+        else c->failed++;
+        pthread_cond_broadcast(&c->wake);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+// checkpoints `mlp` to `path` every `every` steps (see checkpoint_step) on a background thread
+AsyncCheckpointer *checkpoint_start(MLP *mlp, const char *path, int every) {
+    if (every < 1) { // checkpoint_step takes the step modulo `every`
+        fprintf(stderr, "Error: cannot checkpoint every %d steps\n", every);
+        return NULL;
+    }
+    AsyncCheckpointer *c = malloc(sizeof(AsyncCheckpointer));
+    c->mlp = mlp;
+    c->path = strdup(path);
+    c->every = every;
+    c->staging = malloc(mlp_nfloats(mlp) * sizeof(float));
+    c->pending = false;
+    c->stop = false;
+    c->written = 0;
+    c->skipped = 0;
+    c->failed = 0;
+    c->last_blocked_ms = 0;
+    c->total_blocked_ms = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    if (pthread_create(&c->thread, NULL, checkpoint_thread, c) != 0) {
+        fprintf(stderr, "Error: could not start checkpoint thread\n");
+        exit(1);
+    }
+    return c;
+}
+
+// call at a step boundary (after update_params). on every `every`th step this copies the
+// params into the staging blob and hands it to the writer, which is all the training
+// thread pays for. if the previous checkpoint is still being written, this one is skipped
+// rather than waited for
+void checkpoint_step(AsyncCheckpointer *c, int step) {
+    if (step % c->every != 0) return;
+
+    double start = now_ms();
+    TRACE_BEGIN("checkpoint_step");
+    pthread_mutex_lock(&c->lock);
+    if (c->pending) {
+        c->skipped++;
+    } else {
+        mlp_gather_params(c->mlp, c->staging);
+        c->pending = true;
+        pthread_cond_signal(&c->wake);
+    }
+    pthread_mutex_unlock(&c->lock);
+    TRACE_END("checkpoint_step");
+    c->last_blocked_ms = now_ms() - start;
+    c->total_blocked_ms += c->last_blocked_ms;
+}
+
+// waits for the checkpoint in flight (if any) to be written, then shuts the writer down.
+// returns how many checkpoints were written
+int checkpoint_stop(AsyncCheckpointer *c) {
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_broadcast(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    int written = c->written;
+
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wake);
+    free(c->staging);
+    free(c->path);
+    free(c);
+    return written;
+}
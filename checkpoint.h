@@ -0,0 +1,60 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "neuralnetwork.h"
+
+// on-disk layout: header, one CheckpointLayer per layer, zero padding up to blob_offset
+// (a multiple of CHECKPOINT_ALIGN), then the parameter blob of nfloats float32s.
+// the blob holds, per layer, the weights (nout x nin, row-major) followed by the biases
+#define CHECKPOINT_MAGIC "MGCK"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 64
+
+typedef struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t inputdim;
+    uint32_t nlayers;
+    uint64_t blob_offset;
+    uint64_t nfloats;
+} CheckpointHeader;
+
+typedef struct CheckpointLayer {
+    uint32_t nout;
+    uint32_t activation;
+} CheckpointLayer;
+
+// background checkpointing: the training thread only copies the params into `staging`,
+// a writer thread serializes, fsyncs and renames it into place
+typedef struct AsyncCheckpointer {
+    MLP *mlp;
+    char *path;
+    int every;
+    float *staging; // mlp_nfloats floats, owned by the writer while pending is set
+    bool pending;
+    bool stop;
+    int written;
+    int skipped; // snapshots dropped because the previous one was still being written
+    int failed;
+    double last_blocked_ms; // time the training thread spent in the last checkpoint_step
+    double total_blocked_ms;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+} AsyncCheckpointer;
+
+uint64_t mlp_nfloats(MLP *mlp);
+void mlp_gather_params(MLP *mlp, float *blob);
+
+int mlp_save(MLP *mlp, const char *path);
+MLP *mlp_load(const char *path);
+MLP *mlp_load_mapped(const char *path);
+
+AsyncCheckpointer *checkpoint_start(MLP *mlp, const char *path, int every);
+void checkpoint_step(AsyncCheckpointer *c, int step);
+int checkpoint_stop(AsyncCheckpointer *c);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include "dataset.h"
+#include "trace.h"
+
+#define CSV_BUF_SIZE (1 << 16) // also the longest line we accept
+#define CSV_MAX_COLS 4096
+#define PREFETCH_SPIN 64 // yields before the producer sleeps on a full slot
+
+// returns 0 on success, -1 (with a message on stderr) on failure
+int dataset_write(const char *path, const float *rows, int nrows, int ninputs, int ntargets) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    DatasetHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DATASET_MAGIC, 4);
+    h.version = DATASET_VERSION;
+    h.dtype = DATASET_F32;
+    h.ninputs = ninputs;
+    h.ntargets = ntargets;
+    h.nrows = nrows;
+
+    size_t n = (size_t)nrows * (ninputs + ntargets);
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(rows, sizeof(float), n, f) != n) {
+        perror(path);
+        fclose(f);
+        return -1;
+    }
+    if (fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+// maps the whole file read-only. only the header is touched here, the rows are paged in
+// by the kernel as training reads them, so opening costs the same for 1 KB or 10 GB
+Dataset *dataset_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(DatasetHeader)) {
+        fprintf(stderr, "Error: %s is too small to be a dataset\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (map == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    const DatasetHeader *h = map;
+    if (memcmp(h->magic, DATASET_MAGIC, 4) != 0 || h->version != DATASET_VERSION || h->dtype != DATASET_F32) {
+        fprintf(stderr, "Error: %s is not a version %d float32 dataset\n", path, DATASET_VERSION);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    // Dataset keeps these as ints. with both capped at INT_MAX the size below is < 2^64
+    uint64_t stride = (uint64_t)h->ninputs + h->ntargets;
+    if (stride == 0 || stride > INT_MAX || h->nrows > INT_MAX) {
+        fprintf(stderr, "Error: %s has an invalid shape (%llu rows of %llu floats)\n", path,
+                (unsigned long long)h->nrows, (unsigned long long)stride);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    uint64_t expected = sizeof(DatasetHeader) + h->nrows * stride * sizeof(float);
+    if ((uint64_t)st.st_size != expected) {
+        fprintf(stderr, "Error: %s is truncated (expected %llu bytes, got %llu)\n", path,
+                (unsigned long long)expected, (unsigned long long)st.st_size);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    Dataset *ds = malloc(sizeof(Dataset));
+    ds->nrows = (int)h->nrows;
+    ds->ninputs = (int)h->ninputs;
+    ds->ntargets = (int)h->ntargets;
+    ds->stride = (int)stride;
+    ds->rows = (const float *)(h + 1);
+    ds->map = map;
+    ds->map_size = st.st_size;
+    return ds;
+}
+
+void dataset_close(Dataset *ds) {
+    munmap(ds->map, ds->map_size);
+    free(ds);
+}
+
+static const double pow10_table[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static double pow10_int(int e) {
+    if (e >= 0 && e <= 22) return pow10_table[e];
+    double r = 1.0, b = (e < 0) ? 0.1 : 10.0;
+    for (int n = (e < 0) ? -e : e; n > 0; n >>= 1, b *= b) {
+        if (n & 1) r *= b;
+    }
+    return r;
+}
+
+// parses [+-]digits[.digits][(e|E)[+-]digits] starting at *p and advances *p past it.
+// all digits are accumulated in one integer and scaled once at the end, which is exact
+// for anything with up to 19 significant digits (plenty for float32).
+// returns 0 on success, -1 if there was no number at *p
+static int parse_float(const char **p, const char *end, float *out) {
+    const char *s = *p;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+
+    bool neg = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = (*s == '-');
+        s++;
+    }
+
+    uint64_t mant = 0;
+    int ndigits = 0, exp10 = 0;
+    for (; s < end && *s >= '0' && *s <= '9'; s++, ndigits++) {
+        if (mant < 1000000000000000000ULL) mant = mant * 10 + (*s - '0');
+        else exp10++; // digits past the 19th only shift the magnitude
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && *s >= '0' && *s <= '9'; s++, ndigits++) {
+            if (mant < 1000000000000000000ULL) {
+                mant = mant * 10 + (*s - '0');
+                exp10--;
+            }
+        }
+    }
+    if (ndigits == 0) return -1;
+
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s + 1;
+        bool eneg = false;
+        if (e < end && (*e == '-' || *e == '+')) {
+            eneg = (*e == '-');
+            e++;
+        }
+        if (e < end && *e >= '0' && *e <= '9') {
+            int ev = 0;
+            for (; e < end && *e >= '0' && *e <= '9'; e++) {
+                if (ev < 10000) ev = ev * 10 + (*e - '0');
+            }
+            exp10 += eneg ? -ev : ev;
+            s = e;
+        }
+    }
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+
+    double v = (exp10 < 0) ? (double)mant / pow10_int(-exp10) : (double)mant * pow10_int(exp10);
+    *out = (float)(neg ? -v : v);
+    *p = s;
+    return 0;
+}
+
+// parses one CSV line into vals, returns the number of columns or -1 on a malformed field
+static int parse_csv_line(const char *s, const char *end, float *vals) {
+    int ncols = 0;
+    while (1) {
+        if (ncols == CSV_MAX_COLS || parse_float(&s, end, &vals[ncols]) != 0) return -1;
+        ncols++;
+        if (s == end) return ncols;
+        if (*s != ',') return -1;
+        s++;
+    }
+}
+
+// converts a CSV file (one sample per line, the last ntargets columns are targets) into the
+// binary format above, streaming through a fixed CSV_BUF_SIZE buffer so any file size works.
+// a first line that doesn't parse as numbers is taken as a header and skipped.
+// returns the number of rows written, or -1 (with a message on stderr) on failure
+long dataset_from_csv(const char *csv_path, const char *out_path, int ntargets) {
+    FILE *in = fopen(csv_path, "rb");
+    if (in == NULL) {
+        perror(csv_path);
+        return -1;
+    }
+    FILE *out = fopen(out_path, "wb");
+    if (out == NULL) {
+        perror(out_path);
+        fclose(in);
+        return -1;
+    }
+
+    DatasetHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DATASET_MAGIC, 4);
+    h.version = DATASET_VERSION;
+    h.dtype = DATASET_F32;
+    fwrite(&h, sizeof(h), 1, out); // placeholder, patched once we know the shape
+
+    char *buf = malloc(CSV_BUF_SIZE);
+    float *vals = malloc(CSV_MAX_COLS * sizeof(float));
+    size_t len = 0;
+    long nrows = 0, line = 0;
+    int ncols = -1;
+    bool eof = false, ok = true;
+
+    while (ok && !(eof && len == 0)) {
+        if (!eof) {
+            size_t n = fread(buf + len, 1, CSV_BUF_SIZE - len, in);
+            len += n;
+            eof = (n == 0);
+        }
+
+        char *start = buf;
+        char *buf_end = buf + len;
+        while (ok) {
+            char *nl = memchr(start, '\n', buf_end - start);
+            if (nl == NULL) {
+                if (!eof || start == buf_end) break;
+                nl = buf_end; // last line without a trailing newline
+            }
+            char *line_end = nl;
+            if (line_end > start && line_end[-1] == '\r') line_end--;
+            line++;
+
+            if (line_end > start) { // skip blank lines
+                int n = parse_csv_line(start, line_end, vals);
+                if (n < 0 && line == 1) {
+                    // header row
+                } else if (n < 0 || (ncols >= 0 && n != ncols) || n <= ntargets) {
+                    fprintf(stderr, "Error: %s:%ld: malformed row\n", csv_path, line);
+                    ok = false;
+                } else {
+                    ncols = n;
+                    if (fwrite(vals, sizeof(float), n, out) != (size_t)n) {
+                        perror(out_path);
+                        ok = false;
+                    }
+                    nrows++;
+                }
+            }
+            start = (nl == buf_end) ? buf_end : nl + 1;
+        }
+
+        // carry the unfinished line over to the front of the buffer
+        len = buf_end - start;
+        memmove(buf, start, len);
+        if (ok && len == CSV_BUF_SIZE) {
+            fprintf(stderr, "Error: %s:%ld: line longer than %d bytes\n", csv_path, line + 1, CSV_BUF_SIZE);
+            ok = false;
+        }
+        if (eof) len = 0;
+    }
+
+    if (ok) {
+        h.ninputs = (ncols < 0) ? 0 : ncols - ntargets;
+        h.ntargets = ntargets;
+        h.nrows = nrows;
+        if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, out) != 1) {
+            perror(out_path);
+            ok = false;
+        }
+    }
+
+    free(buf);
+    free(vals);
+    fclose(in);
+    if (fclose(out) != 0 && ok) {
+        perror(out_path);
+        ok = false;
+    }
+    return ok ? nrows : -1;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void shuffle(int *order, int n, unsigned int *seed) {
+    for (int i = n - 1; i > 0; i--) { // Fisher-Yates
+        int j = rand_r(seed) % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+// batches run straight across epoch boundaries, reshuffling whenever the order runs out
+static void fill_batch(Prefetcher *p, Batch *b) {
+    const Dataset *ds = p->ds;
+    for (int k = 0; k < p->batch_size; k++) {
+        if (p->cursor == ds->nrows) {
+            shuffle(p->order, ds->nrows, &p->seed);
+            p->cursor = 0;
+        }
+        // this copy is where the mapped pages get faulted in, off the training thread
+        memcpy(b->rows + (size_t)k * ds->stride, dataset_row(ds, p->order[p->cursor++]), ds->stride * sizeof(float));
+    }
+    b->size = p->batch_size;
+}
+
+static void *prefetch_thread(void *arg) {
+    Prefetcher *p = arg;
+    trace_thread_name("prefetch");
+    for (int slot = 0; ; slot ^= 1) {
+        // trainer still owns this slot: a short spin covers a quick handoff, after that sleep
+        // rather than burn a core for a whole training step
+        for (int spin = 0; spin < PREFETCH_SPIN && atomic_load_explicit(&p->ready[slot], memory_order_acquire); spin++) {
+            if (atomic_load_explicit(&p->stop, memory_order_relaxed)) return NULL;
+            sched_yield();
+        }
+        pthread_mutex_lock(&p->lock);
+        while (atomic_load_explicit(&p->ready[slot], memory_order_acquire) && !atomic_load_explicit(&p->stop, memory_order_relaxed)) {
+            pthread_cond_wait(&p->slot_freed, &p->lock);
+        }
+        pthread_mutex_unlock(&p->lock);
+        if (atomic_load_explicit(&p->stop, memory_order_relaxed)) return NULL;
+        TRACE_BEGIN("fill_batch");
+        fill_batch(p, &p->slots[slot]);
+        TRACE_END("fill_batch");
+        atomic_store_explicit(&p->ready[slot], 1, memory_order_release);
+    }
+}
+
+Prefetcher *prefetch_start(const Dataset *ds, int batch_size, unsigned int seed) {
+    if (ds->nrows == 0 || batch_size <= 0) { // fill_batch needs at least one row to cycle through
+        fprintf(stderr, "Error: cannot prefetch batches of %d from a dataset of %d rows\n", batch_size, ds->nrows);
+        return NULL;
+    }
+    Prefetcher *p = malloc(sizeof(Prefetcher));
+    p->ds = ds;
+    p->batch_size = batch_size;
+    for (int i = 0; i < 2; i++) {
+        p->slots[i].size = 0;
+        p->slots[i].rows = malloc((size_t)batch_size * ds->stride * sizeof(float));
+        atomic_init(&p->ready[i], 0);
+    }
+    atomic_init(&p->stop, 0);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->slot_freed, NULL);
+    p->consumer_slot = -1;
+    p->order = malloc(ds->nrows * sizeof(int));
+    for (int i = 0; i < ds->nrows; i++) p->order[i] = i;
+    p->cursor = ds->nrows; // shuffle before the first batch
+    p->seed = seed;
+    p->last_wait_ms = 0;
+    p->total_wait_ms = 0;
+
+    if (pthread_create(&p->thread, NULL, prefetch_thread, p) != 0) {
+        fprintf(stderr, "Error: could not start prefetch thread\n");
+        exit(1);
+    }
+    return p;
+}
+
+// hands back the previous batch to the producer and returns the next one. the returned
+// batch stays valid until the following call
+const Batch *prefetch_next(Prefetcher *p) {
+    if (p->consumer_slot >= 0) {
+        atomic_store_explicit(&p->ready[p->consumer_slot], 0, memory_order_release);
+        // the producer checks the flag under the lock before it sleeps, so this can't be missed
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_signal(&p->slot_freed);
+        pthread_mutex_unlock(&p->lock);
+    }
+    int slot = (p->consumer_slot < 0) ? 0 : p->consumer_slot ^ 1;
+
+    double start = now_ms();
+    TRACE_BEGIN("prefetch_wait");
+    while (!atomic_load_explicit(&p->ready[slot], memory_order_acquire)) {
+        sched_yield();
+    }
+    TRACE_END("prefetch_wait");
+    p->last_wait_ms = now_ms() - start;
+    p->total_wait_ms += p->last_wait_ms;
+
+    p->consumer_slot = slot;
+    return &p->slots[slot];
+}
+
+void prefetch_stop(Prefetcher *p) {
+    atomic_store(&p->stop, 1);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->slot_freed);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->slot_freed);
+    free(p->slots[0].rows);
+    free(p->slots[1].rows);
+    free(p->order);
+    free(p);
+}
@@ -0,0 +1,79 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// on-disk layout: a 32 byte header followed by nrows contiguous float32 rows,
+// each row being ninputs features and then ntargets targets
+#define DATASET_MAGIC "MGDS"
+#define DATASET_VERSION 1
+#define DATASET_F32 0
+
+typedef struct DatasetHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t ninputs;
+    uint32_t ntargets;
+    uint32_t reserved;
+    uint64_t nrows;
+} DatasetHeader;
+
+typedef struct Dataset {
+    int nrows;
+    int ninputs;
+    int ntargets;
+    int stride; // floats per row (ninputs + ntargets)
+    const float *rows; // points straight into the mapping
+    void *map;
+    size_t map_size;
+} Dataset;
+
+int dataset_write(const char *path, const float *rows, int nrows, int ninputs, int ntargets);
+long dataset_from_csv(const char *csv_path, const char *out_path, int ntargets);
+Dataset *dataset_open(const char *path);
+void dataset_close(Dataset *ds);
+
+// row i: ninputs features, then its targets at dataset_targets(ds, i)
+static inline const float *dataset_row(const Dataset *ds, int i) {
+    return ds->rows + (size_t)i * ds->stride;
+}
+
+static inline const float *dataset_targets(const Dataset *ds, int i) {
+    return dataset_row(ds, i) + ds->ninputs;
+}
+
+// double-buffered minibatches: a producer thread shuffles and gathers the next batch into
+// one slot while the trainer works on the other. the handoff is a single-producer /
+// single-consumer flag per slot. a producer that finds both slots full spins briefly, then
+// sleeps on slot_freed until the trainer hands one back
+typedef struct Batch {
+    int size;
+    float *rows; // size x stride, gathered into one contiguous block
+} Batch;
+
+typedef struct Prefetcher {
+    const Dataset *ds;
+    int batch_size;
+    Batch slots[2];
+    atomic_int ready[2]; // 1 = filled by the producer, 0 = free for it
+    atomic_int stop;
+    pthread_mutex_t lock; // only guards the producer's sleep, the flags stay lock-free
+    pthread_cond_t slot_freed;
+    int consumer_slot; // slot handed out by the last prefetch_next, -1 before the first
+    int *order; // shuffled row indices for the current epoch
+    int cursor;
+    unsigned int seed;
+    pthread_t thread;
+    double last_wait_ms; // time the trainer spent blocked in the last prefetch_next
+    double total_wait_ms;
+} Prefetcher;
+
+Prefetcher *prefetch_start(const Dataset *ds, int batch_size, unsigned int seed);
+const Batch *prefetch_next(Prefetcher *p);
+void prefetch_stop(Prefetcher *p);
+
+#endif // DATASET_H
@@ -1,7 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include "micrograd.h"
 #include "neuralnetwork.h"
+#include "dataset.h"
+#include "checkpoint.h"
+#include "trace.h"
 
 
 void demo_calculus() {
@@ -17,9 +21,9 @@ void demo_calculus() {
     // 2. Build the Graph (Forward Pass)
     // f = a^2 + 3*b - 5
     Value *a_squared = v_pow(a, 2);           // a^2 = 9
-    Value *three_b = mul(new_val(3, NULL, NULL), b); // 3*b = 6
+    Value *three_b = mul_scalar(b, 3);        // 3*b = 6
     Value *sum = add(a_squared, three_b);          // 9 + 6 = 15
-    Value *f = add(sum, new_val(-5, NULL, NULL)); // 15 - 5 = 10
+    Value *f = add_scalar(sum, -5);           // 15 - 5 = 10
     
     printf("Forward Pass Results:\n");
     printf("   a = %.2f\n", a->data);
@@ -79,62 +83,104 @@ void demo_xor() {
     printf("\n--- 3. Training Demo: Solving XOR ---\n");
     printf("Training a 2-layer MLP to solve the XOR problem.\n");
     
-    // define XOR dataset
-    int inputs[4][2] = {{0, 0}, {0, 1}, {1, 0}, {1, 1}};
-    int targets[4] = {0, 1, 1, 0};
+    // define XOR dataset, the way real data arrives: as a CSV, converted once to the
+    // binary format so the training loop never parses text
+    const char *csv_path = "xor.csv";
+    const char *bin_path = "xor.bin";
+    FILE *f = fopen(csv_path, "w");
+    fputs("x0,x1,y\n0,0,0\n0,1,1\n1,0,1\n1,1,0\n", f);
+    fclose(f);
+    dataset_from_csv(csv_path, bin_path, 1);
+    Dataset *ds = dataset_open(bin_path);
 
     // define multi-layer perceptron
-    int inputdim = 2;
+    int inputdim = ds->ninputs;
     int nlayers = 2;
     int layerdims[2] = {4, 1}; //hidden=4, output=1
-    MLP *mlp = new_mlp(inputdim, nlayers, layerdims);
+    Activation activations[2] = {ACT_TANH, ACT_NONE};
+    MLP *mlp = new_mlp(inputdim, nlayers, layerdims, activations);
     
+    // a background thread shuffles and gathers the next minibatch while we train on this one
+    Prefetcher *loader = prefetch_start(ds, ds->nrows, 1234);
+    // and another one writes a checkpoint every 1000 steps without holding up training
+    const char *ckpt_path = "xor.ckpt";
+    AsyncCheckpointer *ckpt = checkpoint_start(mlp, ckpt_path, 1000);
+
     printf("Model initialized. Training for 10000 steps...\n");
     // training loop
+    double wait_ms = 0;
     for (int step=0; step<10000; step++) {
+        const Batch *batch = prefetch_next(loader);
+        wait_ms += loader->last_wait_ms;
+
         Value *total_loss = new_val(0, NULL, NULL);
+        // each sample's graph only shares the params with the others, so backward_samples
+        // can sweep them concurrently given where each one starts and its loss
+        TapeMark starts[batch->size];
+        Value *losses[batch->size];
         // batch loop
-        for (int i=0; i<4; i++) {
-            Value *x[2];
-            x[0] = new_val(inputs[i][0], NULL, NULL);
-            x[1] = new_val(inputs[i][1], NULL, NULL);
-
-            Value *y = new_val(targets[i], NULL, NULL);
-
-            Value **out = forward(mlp, x);
+        for (int i=0; i<batch->size; i++) {
+            // rows are bound straight from the batch buffer: no input or target nodes
+            const float *row = batch->rows + i * ds->stride;
+            starts[i] = tape_mark();
+            Value **out = forward_input(mlp, row);
 
-            Value *diff = sub(out[0], y);
+            TRACE_BEGIN("loss");
+            Value *diff = add_scalar(out[0], -row[ds->ninputs]);
             Value *mse = v_pow(diff, 2);
+            losses[i] = mse;
             total_loss = add(total_loss, mse);
+            TRACE_END("loss");
         }
         zero_grad();
-        backward(total_loss, false);
+        backward_samples(total_loss, starts, losses, batch->size, false);
         update_params(0.005);
+        checkpoint_step(ckpt, step);
 
         if (step%500 == 0) {
-            printf("Step: %-4d | Loss: %.8f\n", step, total_loss->data);
+            printf("Step: %-4d | Loss: %.8f | Data wait: %.4f ms/step\n", step, total_loss->data, wait_ms / (step ? 500 : 1));
+            wait_ms = 0;
         }
     }
+    prefetch_stop(loader);
+    double blocked_ms = ckpt->total_blocked_ms;
+    int written = checkpoint_stop(ckpt);
+    printf("Wrote %d checkpoints to %s, training blocked for %.4f ms in total\n", written, ckpt_path, blocked_ms);
 
     // check results
     printf("Results:\n");
-    for (int i=0; i<4; i++) {
-        Value *x[2];
-        x[0] = new_val(inputs[i][0], NULL, NULL);
-        x[1] = new_val(inputs[i][1], NULL, NULL);
+    for (int i=0; i<ds->nrows; i++) {
+        const float *x = dataset_row(ds, i);
+        Value **out = forward_input(mlp, x);
 
-        Value **out = forward(mlp, x);
-
-        printf("%d ^ %d = %f (target: %d)\n", inputs[i][0], inputs[i][1], out[0]->data, targets[i]);
+        printf("%.0f ^ %.0f = %f (target: %.0f)\n", x[0], x[1], out[0]->data, dataset_targets(ds, i)[0]);
     }
 
     free_mlp(mlp);
+    dataset_close(ds);
+    remove(csv_path);
+    remove(bin_path);
+    remove(ckpt_path);
 }
 
 int main() {
     srand(time(NULL));
+    // MICROGRAD_TRACE=xor.json ./demo_run writes a timeline of the run (open it in ui.perfetto.dev)
+    const char *trace_path = getenv("MICROGRAD_TRACE");
+    if (trace_path) {
+        trace_thread_name("main");
+        trace_start();
+    }
+    // MICROGRAD_THREADS=4 ./demo_run runs the per-sample backward of the XOR demo on 4 threads
+    const char *threads = getenv("MICROGRAD_THREADS");
+    if (threads) set_backward_threads(atoi(threads));
     demo_calculus();
     demo_neuron();
     demo_xor();
+    if (trace_path) {
+        trace_stop();
+        trace_export(trace_path);
+    }
+    set_backward_threads(1);
     return 0;
 }
@@ -1,10 +1,48 @@
+#include <string.h>
 #include "micrograd.h"
+#include "trace.h"
+#include "threadpool.h"
 
-#define MAX_TAPE_SIZE 100000
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static Value *parameters_head= NULL;
 static Value tape_memory[MAX_TAPE_SIZE];
 static int tape_head = 0;
+// bumped whenever backward is done with the recorded graph (or it is freed). a placeholder
+// keeps the epoch in which a node last read it, see bind_inputs
+static uintptr_t tape_epoch = 1;
+
+// memory accounting, see mg_memstats
+static int peak_tape_nodes = 0;
+static size_t peak_tape_bytes = 0;
+static long param_count = 0;
+static long model_mallocs = 0;
+static size_t model_malloc_bytes = 0;
+
+// tape_alloc only compares against tape_limit; it is MAX_TAPE_SIZE unless a soft limit
+// is armed, so the soft limit costs nothing extra per node
+static int tape_limit = MAX_TAPE_SIZE;
+static int tape_soft_limit = 0;
+static void (*tape_limit_fn)(MemStats *stats, void *arg) = NULL;
+static void *tape_limit_arg = NULL;
+
+// side storage for ops that need more than prev[2] (e.g. the input list of a dense layer).
+// it is a bump allocator just like the tape, and is freed together with it
+static void *tape_arena[MAX_ARENA_WORDS];
+static int arena_head = 0;
+
+static void *arena_alloc(size_t bytes) {
+    int words = (bytes + sizeof(void*) - 1) / sizeof(void*);
+    if (arena_head + words > MAX_ARENA_WORDS) {
+        fprintf(stderr, "Error: Tape arena size exceeded!\n");
+        exit(1);
+    }
+    void *p = &tape_arena[arena_head];
+    arena_head += words;
+    return p;
+}
 
 double random_uniform(double min, double max) {
     return min + ((double)rand() / RAND_MAX) * (max - min);
@@ -14,43 +52,95 @@ static void noop_backward(Value *self, Value *prev[2]) {
     // do nothing (leaf nodes), default
 }
 
+// per-thread gradient buffers for a parallel backward (see backward_parallel): nodes is
+// indexed by tape_idx, params by param index (see param_slot). NULL on a thread that
+// isn't inside a parallel sweep, and then grads are accumulated in place. nodes is NULL
+// when each thread owns the tape nodes it writes (see backward_samples), and params is
+// NULL in PARAM_GRAD_ATOMIC mode
+typedef struct GradBuffer {
+    float *nodes;
+    float *params;
+} GradBuffer;
+
+static _Thread_local GradBuffer *grad_buffer = NULL;
+
+// params have tape_idx -2, -3, ... so they can be told apart from tape nodes and from
+// input placeholders (-1) without a lookup
+static inline long param_slot(Value *v) {
+    return -2L - v->tape_idx;
+}
+
+static void atomic_add_float(float *p, float g) {
+    float old, new;
+    __atomic_load(p, &old, __ATOMIC_RELAXED);
+    do {
+        new = old + g;
+    } while (!__atomic_compare_exchange(p, &old, &new, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void acc_grad_buffered(Value *v, float g) {
+    if (v->tape_idx >= 0) {
+        if (grad_buffer->nodes != NULL) grad_buffer->nodes[v->tape_idx] += g;
+        else v->grad += g;
+    } else if (v->tape_idx <= -2 && grad_buffer->params != NULL) {
+        grad_buffer->params[param_slot(v)] += g;
+    } else {
+        atomic_add_float(&v->grad, g); // PARAM_GRAD_ATOMIC, and input placeholders (few, no slot)
+    }
+}
+
+// every backward function accumulates through here, so the same kernels run serially
+// (plain +=) and inside a parallel level (into this thread's buffers)
+static inline void acc_grad(Value *v, float g) {
+    if (__builtin_expect(grad_buffer == NULL, 1)) v->grad += g;
+    else acc_grad_buffered(v, g);
+}
+
 static void add_backward(Value *self, Value *prev[2]) {
-    prev[0]->grad += 1.0 * self->grad; // think chain rule, local derivative is 1 for addition
-    prev[1]->grad += 1.0 * self->grad;
+    acc_grad(prev[0], 1.0 * self->grad); // think chain rule, local derivative is 1 for addition
+    acc_grad(prev[1], 1.0 * self->grad);
 }
 
 static void sub_backward(Value *self, Value *prev[2]) {
-    prev[0]->grad += 1.0 * self->grad;
-    prev[1]->grad -= 1.0 * self->grad;
+    acc_grad(prev[0], 1.0 * self->grad);
+    acc_grad(prev[1], -self->grad);
+}
+
+static void add_scalar_backward(Value *self, Value *prev[2]) {
+    acc_grad(prev[0], self->grad); // the immediate is a constant, so only one input gets a gradient
 }
 
 static void mul_backward(Value *self, Value *prev[2]) {
-    prev[0]->grad += prev[1]->data * self->grad; // think chain rule, dz/dx = (dz/du)*(du/dx), local derivative du/dx is the coefficient
-    prev[1]->grad += prev[0]->data * self->grad;
+    acc_grad(prev[0], prev[1]->data * self->grad); // think chain rule, dz/dx = (dz/du)*(du/dx), local derivative du/dx is the coefficient
+    acc_grad(prev[1], prev[0]->data * self->grad);
+}
+
+static void mul_scalar_backward(Value *self, Value *prev[2]) {
+    acc_grad(prev[0], self->imm * self->grad);
 }
 
 static void div_backward(Value *self, Value *prev[2]) {
     float x = prev[0]->data;
     float y = prev[1]->data;
     // z = x / y, dz/dx = 1/y, dz/dy = -x / y^2
-    prev[0]->grad += (1.0 / y) * self->grad;
-    prev[1]->grad += (-x / (y*y)) * self->grad;
+    acc_grad(prev[0], (1.0 / y) * self->grad);
+    acc_grad(prev[1], (-x / (y*y)) * self->grad);
 }
 
 static void pow_backward(Value *self, Value *prev[2]) {
     float x = prev[0]->data;
-    float n = prev[1]->data;
-    prev[0]->grad += (n * pow(x, n-1)) * self->grad; // local derivative of x^n is n*x^n-1 (uses math pow)
+    float n = self->imm; // exponent lives in the node, no constant leaf on the tape
+    acc_grad(prev[0], (n * pow(x, n-1)) * self->grad); // local derivative of x^n is n*x^n-1 (uses math pow)
 }
 
 static void exp_backward(Value *self, Value *prev[2]) {
     assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0 
-    prev[0]->grad += self->data * self->grad; // derivative of e^x is e^x
+    acc_grad(prev[0], self->data * self->grad); // derivative of e^x is e^x
 }
 
 static void tanh_backward(Value *self, Value *prev[2]) {
     assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
-    prev[0]->grad += (1 - (self->data * self->data)) * self->grad; // local derivative of tanh * gradient (chain rule again)
+    acc_grad(prev[0], (1 - (self->data * self->data)) * self->grad); // local derivative of tanh * gradient (chain rule again)
 }
 
 static void relu_backward(Value *self, Value *prev[2]) {
@@ -58,28 +148,360 @@ static void relu_backward(Value *self, Value *prev[2]) {
     float x = prev[0]->data;
     // relu is y=x for x>0, and y=0 for x<=0
     // => local derivative is 1 for x>0, and 0 for x<=0
-    prev[0]->grad += (x > 0) * self->grad;
+    acc_grad(prev[0], (x > 0) * self->grad);
+}
+
+static void leaky_relu_backward(Value *self, Value *prev[2]) {
+    assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
+    // output keeps the sign of the input, so we don't need to look at the input
+    acc_grad(prev[0], ((self->data > 0) ? 1.0f : LEAKY_RELU_SLOPE) * self->grad);
+}
+
+static void sigmoid_backward(Value *self, Value *prev[2]) {
+    assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
+    float y = self->data;
+    acc_grad(prev[0], y * (1 - y) * self->grad); // d/dx sigmoid(x) = sigmoid(x) * (1 - sigmoid(x))
+}
+
+#define GELU_K 0.7978845608f // sqrt(2/pi)
+#define GELU_C 0.044715f
+
+static void gelu_backward(Value *self, Value *prev[2]) {
+    assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
+    float x = prev[0]->data;
+    float t = self->imm; // tanh of the inner term, saved by the forward pass
+    // y = 0.5x(1+t), t = tanh(k(x + cx^3))
+    // => dy/dx = 0.5(1+t) + 0.5x(1-t^2) * k(1 + 3cx^2)
+    float dinner = GELU_K * (1 + 3 * GELU_C * x * x);
+    acc_grad(prev[0], (0.5f * (1 + t) + 0.5f * x * (1 - t * t) * dinner) * self->grad);
+}
+
+static void log_backward(Value *self, Value *prev[2]) {
+    assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
+    acc_grad(prev[0], self->grad / prev[0]->data); // d/dx ln(x) = 1/x
+}
+
+static void sqrt_backward(Value *self, Value *prev[2]) {
+    assert(prev[0] != NULL && prev[1] == NULL); // we assume only child occupies index 0
+    acc_grad(prev[0], (0.5f / self->data) * self->grad); // d/dx sqrt(x) = 1/(2*sqrt(x))
+}
+
+// malloc for model storage (params, neurons, layers), counted in mg_memstats
+void *mg_malloc(size_t bytes) {
+    model_mallocs++;
+    model_malloc_bytes += bytes;
+    return malloc(bytes);
 }
 
 Value *new_param(float data) {
-    Value *v = malloc(sizeof(Value));
+    Value *v = mg_malloc(sizeof(Value));
+    v->tape_idx = -2 - param_count; // see param_slot
+    param_count++;
     v->next = parameters_head;
     parameters_head= v;
-    v->tape_idx = -1;
 
     v->data = data;
     v->grad = 0.0;
     v->grad_fn= noop_backward;
     v->prev[0] = NULL;
     v->prev[1] = NULL;
+    v->imm = 0.0;
     return v;
 }
 
-Value *new_val(float data, Value *prev0, Value *prev1) {
-    if (tape_head > MAX_TAPE_SIZE) {
+static void no_grad_backward(Value *self, Value *prev[2]) {
+    // marks a value whose gradient nobody asked for: a constant (see new_const) or an
+    // input placeholder created without requires_grad (see new_inputs)
+}
+
+static bool is_const(Value *v) {
+    return v->grad_fn == no_grad_backward;
+}
+
+// n input placeholders that live outside the tape, in one allocation (free with free_inputs).
+// like params they survive free_vals and are never visited by backward; unlike params they
+// aren't updated. with requires_grad false, dense layers don't accumulate into them at all.
+// the recorded nodes point at them, so backward reads whatever they hold at that time:
+// rebind them only once backward has run (bind_inputs checks this)
+Value **new_inputs(int n, bool requires_grad) {
+    Value **x = malloc(n * sizeof(Value*) + n * sizeof(Value));
+    Value *nodes = (Value *)(x + n);
+    for (int i=0; i<n; i++) {
+        Value *v = &nodes[i];
+        v->tape_idx = -1;
+        v->data = 0.0;
+        v->grad = 0.0;
+        v->grad_fn = requires_grad ? noop_backward : no_grad_backward;
+        v->prev[0] = NULL;
+        v->prev[1] = NULL;
+        v->imm = 0.0;
+        v->ctx = NULL; // no node has read it yet, see note_input_read
+        x[i] = v;
+    }
+    return x;
+}
+
+// placeholders (tape_idx -1) have no use for ctx, so it holds the epoch of their last read
+static inline void note_input_read(Value *v) {
+    if (v != NULL && v->tape_idx == -1) v->ctx = (void *)tape_epoch;
+}
+
+// overwrites the placeholders in place with data[0..n-1] (and clears their grads)
+void bind_inputs(Value **x, const float *data, int n) {
+    for (int i=0; i<n; i++) {
+        if (x[i]->ctx == (void *)tape_epoch) {
+            fprintf(stderr, "Error: Rebinding an input placeholder that the tape still reads (run backward or free_vals first)\n");
+            exit(1);
+        }
+        x[i]->data = data[i];
+        x[i]->grad = 0.0;
+    }
+}
+
+void free_inputs(Value **x) {
+    free(x); // the nodes share the pointer array's allocation
+}
+
+#ifdef MICROGRAD_PROFILE
+// per-op profile: nodes recorded and time spent in backward, keyed by grad_fn
+typedef struct OpProfile {
+    const char *name;
+    void (*grad_fn)(Value *self, Value *prev[2]);
+    long created;
+    long calls;
+    long long ns;
+} OpProfile;
+
+static void dense_backward(Value *self, Value *prev[2]);
+static void dense_out_backward(Value *self, Value *prev[2]);
+static void recompute_backward(Value *self, Value *prev[2]);
+static void recompute_out_backward(Value *self, Value *prev[2]);
+
+static OpProfile op_profile[] = {
+    {"leaf", noop_backward}, {"const", no_grad_backward}, {"add", add_backward}, {"sub", sub_backward},
+    {"mul", mul_backward}, {"div", div_backward}, {"add_scalar", add_scalar_backward},
+    {"mul_scalar", mul_scalar_backward}, {"pow", pow_backward}, {"exp", exp_backward},
+    {"tanh", tanh_backward}, {"relu", relu_backward}, {"leaky_relu", leaky_relu_backward},
+    {"sigmoid", sigmoid_backward}, {"gelu", gelu_backward}, {"log", log_backward},
+    {"sqrt", sqrt_backward}, {"dense", dense_backward}, {"dense_out", dense_out_backward},
+    {"recompute", recompute_backward}, {"recompute_out", recompute_out_backward},
+    {"other", NULL}, // anything not listed above
+};
+#define NUM_OPS (int)(sizeof(op_profile) / sizeof(op_profile[0]))
+
+static long profile_sweeps = 0;
+static long long profile_sweep_ns = 0;
+
+static long long profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static OpProfile *op_lookup(void (*grad_fn)(Value *self, Value *prev[2])) {
+    for (int i=0; i<NUM_OPS - 1; i++) {
+        if (op_profile[i].grad_fn == grad_fn) return &op_profile[i];
+    }
+    return &op_profile[NUM_OPS - 1];
+}
+
+// a sweep is timed in runs of same-op nodes: the clock is only read when the op changes,
+// so a run of 128 dense_out nodes costs one clock read rather than 256. the run state is
+// per thread, so pool workers time their own runs (see backward_parallel)
+static _Thread_local OpProfile *sweep_op = NULL;
+static _Thread_local long long sweep_mark, sweep_start;
+static _Thread_local bool sweep_active = false;
+
+// a pool worker's counts, merged into op_profile by the calling thread after the join
+typedef struct ProfileCounts {
+    long calls[NUM_OPS];
+    long long ns[NUM_OPS];
+} ProfileCounts;
+
+static ProfileCounts *profile_counts = NULL; // one per pool thread
+static _Thread_local ProfileCounts *profile_local = NULL; // set while running as a worker
+
+static void profile_add(OpProfile *op, long calls, long long ns) {
+    if (profile_local != NULL) {
+        profile_local->calls[op - op_profile] += calls;
+        profile_local->ns[op - op_profile] += ns;
+    } else {
+        op->calls += calls;
+        op->ns += ns;
+    }
+}
+
+// calls is 0 for the other threads' slices of a node split across the pool
+static void profile_node(Value *v, long calls) {
+    if (sweep_op != NULL && sweep_op->grad_fn == v->grad_fn) {
+        profile_add(sweep_op, calls, 0);
+        return;
+    }
+    long long t = profile_now();
+    if (sweep_op != NULL) profile_add(sweep_op, 0, t - sweep_mark);
+    if (!sweep_active) {
+        sweep_start = t;
+        sweep_active = true;
+    }
+    sweep_op = op_lookup(v->grad_fn);
+    profile_add(sweep_op, calls, 0);
+    sweep_mark = t;
+}
+
+// closes the current run without ending the sweep, e.g. before the pool takes over
+static void profile_pause() {
+    if (sweep_op == NULL) return;
+    profile_add(sweep_op, 0, profile_now() - sweep_mark);
+    sweep_op = NULL;
+}
+
+static void profile_sweep_end() {
+    if (!sweep_active) return;
+    profile_pause();
+    profile_sweeps++;
+    profile_sweep_ns += profile_now() - sweep_start;
+    sweep_active = false;
+}
+
+static void profile_threads(int nthreads) {
+    free(profile_counts);
+    profile_counts = (nthreads > 1) ? calloc(nthreads, sizeof(ProfileCounts)) : NULL;
+}
+
+static void profile_worker_begin(int tid) {
+    profile_local = &profile_counts[tid];
+}
+
+static void profile_worker_end() {
+    profile_pause();
+    profile_local = NULL;
+}
+
+static void profile_merge(int nthreads) {
+    for (int t=0; t<nthreads; t++) {
+        for (int k=0; k<NUM_OPS; k++) {
+            op_profile[k].calls += profile_counts[t].calls[k];
+            op_profile[k].ns += profile_counts[t].ns[k];
+        }
+        memset(&profile_counts[t], 0, sizeof(ProfileCounts));
+    }
+}
+
+#define PROFILE_CREATE(fn) (op_lookup(fn)->created++)
+#define PROFILE_NODE(v) profile_node(v, 1)
+#define PROFILE_SLICE(v, first) profile_node(v, first)
+#define PROFILE_SWEEP_END() profile_sweep_end()
+#define PROFILE_PAUSE() profile_pause()
+#define PROFILE_THREADS(n) profile_threads(n)
+#define PROFILE_WORKER_BEGIN(tid) profile_worker_begin(tid)
+#define PROFILE_WORKER_END() profile_worker_end()
+#define PROFILE_MERGE(n) profile_merge(n)
+
+void profile_reset() {
+    for (int i=0; i<NUM_OPS; i++) {
+        op_profile[i].created = 0;
+        op_profile[i].calls = 0;
+        op_profile[i].ns = 0;
+    }
+    profile_sweeps = 0;
+    profile_sweep_ns = 0;
+}
+
+static int by_backward_time(const void *a, const void *b) {
+    const OpProfile *x = *(OpProfile * const *)a;
+    const OpProfile *y = *(OpProfile * const *)b;
+    if (x->ns != y->ns) return (x->ns < y->ns) ? 1 : -1;
+    return (x->created < y->created) ? 1 : (x->created > y->created) ? -1 : 0;
+}
+
+// the ops that showed up at all, slowest backward first
+static int profile_sorted(OpProfile **ops) {
+    int n = 0;
+    for (int i=0; i<NUM_OPS; i++) {
+        if (op_profile[i].created > 0 || op_profile[i].calls > 0) ops[n++] = &op_profile[i];
+    }
+    qsort(ops, n, sizeof(OpProfile*), by_backward_time);
+    return n;
+}
+
+void profile_report(FILE *f) {
+    OpProfile *ops[NUM_OPS];
+    int n = profile_sorted(ops);
+    fprintf(f, "%-12s %12s %12s %12s %10s %7s\n", "op", "created", "bwd calls", "bwd ms", "ns/call", "bwd %");
+    for (int i=0; i<n; i++) {
+        OpProfile *op = ops[i];
+        fprintf(f, "%-12s %12ld %12ld %12.3f %10.1f %6.1f%%\n", op->name, op->created, op->calls, op->ns / 1e6,
+                op->calls ? (double)op->ns / op->calls : 0.0, profile_sweep_ns ? 100.0 * op->ns / profile_sweep_ns : 0.0);
+    }
+    fprintf(f, "%ld backward sweeps, %.3f ms total\n", profile_sweeps, profile_sweep_ns / 1e6);
+}
+
+void profile_report_json(FILE *f) {
+    OpProfile *ops[NUM_OPS];
+    int n = profile_sorted(ops);
+    fprintf(f, "{\n  \"enabled\": true,\n  \"sweeps\": %ld,\n  \"backward_ns\": %lld,\n  \"ops\": [\n", profile_sweeps, profile_sweep_ns);
+    for (int i=0; i<n; i++) {
+        fprintf(f, "    {\"op\": \"%s\", \"created\": %ld, \"backward_calls\": %ld, \"backward_ns\": %lld}%s\n",
+                ops[i]->name, ops[i]->created, ops[i]->calls, ops[i]->ns, (i + 1 < n) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+#else
+#define PROFILE_CREATE(fn)
+#define PROFILE_NODE(v)
+#define PROFILE_SLICE(v, first)
+#define PROFILE_SWEEP_END()
+#define PROFILE_PAUSE()
+#define PROFILE_THREADS(n)
+#define PROFILE_WORKER_BEGIN(tid)
+#define PROFILE_WORKER_END()
+#define PROFILE_MERGE(n)
+
+void profile_reset() {}
+
+void profile_report(FILE *f) {
+    fprintf(f, "profiling is compiled out, rebuild with -DMICROGRAD_PROFILE\n");
+}
+
+void profile_report_json(FILE *f) {
+    fprintf(f, "{\"enabled\": false}\n");
+}
+#endif
+
+static void note_peak() {
+    if (tape_head > peak_tape_nodes) peak_tape_nodes = tape_head;
+    if (tape_bytes() > peak_tape_bytes) peak_tape_bytes = tape_bytes();
+}
+
+static void arm_tape_limit() {
+    tape_limit = (tape_limit_fn != NULL && tape_soft_limit < MAX_TAPE_SIZE) ? tape_soft_limit : MAX_TAPE_SIZE;
+}
+
+// calls on_limit(stats, arg) once per recording, when the tape reaches `nodes` nodes
+// (it is re-armed by free_vals, or a tape_rewind back below it). it runs in the middle of recording an op, so it must
+// not free the tape: note it (e.g. end the batch early) and the recording carries on
+// up to MAX_TAPE_SIZE. pass NULL to disarm
+void mg_set_tape_limit(int nodes, void (*on_limit)(MemStats *stats, void *arg), void *arg) {
+    tape_soft_limit = nodes;
+    tape_limit_fn = on_limit;
+    tape_limit_arg = arg;
+    arm_tape_limit();
+}
+
+static void tape_limit_reached() {
+    if (tape_head >= MAX_TAPE_SIZE) {
         fprintf(stderr, "Error: Tape size exceeded!\n");
         exit(1);
     }
+    tape_limit = MAX_TAPE_SIZE; // fire once, then only the hard limit is left
+    MemStats stats = mg_memstats();
+    tape_limit_fn(&stats, tape_limit_arg);
+}
+
+static Value *tape_alloc(float data, Value *prev0, Value *prev1) {
+    if (tape_head >= tape_limit) {
+        tape_limit_reached();
+    }
     Value *v = &tape_memory[tape_head];
     v->tape_idx = tape_head;
     tape_head++;
@@ -88,38 +510,172 @@ Value *new_val(float data, Value *prev0, Value *prev1) {
     v->grad_fn= noop_backward;
     v->prev[0] = prev0;
     v->prev[1] = prev1;
+    v->imm = 0.0;
+    v->ctx = NULL;
+    note_input_read(prev0);
+    note_input_read(prev1);
     return v;
 }
 
-Value *add(Value *self, Value *other) {
-    Value *out = new_val(self->data + other->data, self, other);
-    out->grad_fn = add_backward;
+Value *new_val(float data, Value *prev0, Value *prev1) {
+    PROFILE_CREATE(noop_backward);
+    return tape_alloc(data, prev0, prev1);
+}
+
+// a leaf that never gets a gradient. ops on constants fold instead of being recorded,
+// and the identities below drop ops that wouldn't change their other operand
+Value *new_const(float data) {
+    Value *v = tape_alloc(data, NULL, NULL);
+    v->grad_fn = no_grad_backward;
+    PROFILE_CREATE(no_grad_backward);
+    return v;
+}
+
+// common-subexpression elimination (opt-in, see cse_enable): a small open-addressing table
+// from (op, prev0, prev1, imm) to the tape index of the node that computed it. entries are
+// never cleared; a hit only counts if the slot still holds a live node (below tape_head)
+// with that exact key and the same value, so free_vals, tape_rewind or inputs rebound in
+// between can't produce a stale node
+#define CSE_TABLE_SIZE (1 << 16) // a power of 2
+#define CSE_PROBES 8
+
+typedef struct CseEntry {
+    int idx; // tape index + 1, 0 for empty
+    uint32_t hash; // so most mismatches are rejected without touching the tape
+} CseEntry;
+
+static bool cse_on = false;
+static CseEntry cse_table[CSE_TABLE_SIZE];
+static long cse_lookups = 0;
+static long cse_hits = 0;
+
+static void dense_out_backward(Value *self, Value *prev[2]);
+static void recompute_out_backward(Value *self, Value *prev[2]);
+
+void cse_enable(bool on) {
+    cse_on = on;
+}
+
+CseStats cse_stats() {
+    CseStats s = {cse_lookups, cse_hits, cse_lookups ? (double)cse_hits / cse_lookups : 0.0};
+    return s;
+}
+
+void cse_reset_stats() {
+    cse_lookups = 0;
+    cse_hits = 0;
+}
+
+static uint32_t float_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static uint32_t cse_hash(void (*grad_fn)(Value *self, Value *prev[2]), Value *prev0, Value *prev1, float imm) {
+    uint64_t h = (uint64_t)(uintptr_t)grad_fn * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uintptr_t)prev0) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uintptr_t)prev1) * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ float_bits(imm)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32);
+}
+
+static bool cse_match(CseEntry *e, uint32_t h, void (*grad_fn)(Value *self, Value *prev[2]), Value *prev0, Value *prev1, float imm, float data) {
+    int idx = e->idx - 1;
+    if (e->hash != h || idx >= tape_head) return false;
+    Value *v = &tape_memory[idx];
+    return v->grad_fn == grad_fn && v->prev[0] == prev0 && v->prev[1] == prev1
+        && float_bits(v->imm) == float_bits(imm) && float_bits(v->data) == float_bits(data);
+}
+
+// every op constructor records its node through here
+static Value *new_op(float data, Value *prev0, Value *prev1, float imm, void (*grad_fn)(Value *self, Value *prev[2])) {
+    if (prev0 != NULL && is_const(prev0) && (prev1 == NULL || is_const(prev1))) {
+        return new_const(data); // nothing upstream needs a gradient, only the value matters
+    }
+
+    uint32_t h = 0;
+    // group members (outputs 1.. of a dense layer or segment) aren't standalone ops
+    bool cse = cse_on && prev0 != NULL && grad_fn != dense_out_backward && grad_fn != recompute_out_backward;
+    if (cse) {
+        if ((grad_fn == add_backward || grad_fn == mul_backward) && prev1 < prev0) {
+            Value *tmp = prev0; // commutative, so a+b and b+a share a key
+            prev0 = prev1;
+            prev1 = tmp;
+        }
+        cse_lookups++;
+        h = cse_hash(grad_fn, prev0, prev1, imm);
+        for (int p=0; p<CSE_PROBES; p++) {
+            CseEntry *e = &cse_table[(h + p) & (CSE_TABLE_SIZE - 1)];
+            if (e->idx == 0) break;
+            if (cse_match(e, h, grad_fn, prev0, prev1, imm, data)) {
+                cse_hits++;
+                return &tape_memory[e->idx - 1];
+            }
+        }
+    }
+
+    Value *out = tape_alloc(data, prev0, prev1);
+    out->imm = imm;
+    out->grad_fn = grad_fn;
+    PROFILE_CREATE(grad_fn);
+
+    if (cse) {
+        // first empty or dead slot along the probe, else evict the home slot
+        CseEntry *slot = &cse_table[h & (CSE_TABLE_SIZE - 1)];
+        for (int p=0; p<CSE_PROBES; p++) {
+            CseEntry *e = &cse_table[(h + p) & (CSE_TABLE_SIZE - 1)];
+            if (e->idx == 0 || e->idx - 1 >= out->tape_idx) {
+                slot = e;
+                break;
+            }
+        }
+        slot->idx = out->tape_idx + 1;
+        slot->hash = h;
+    }
     return out;
 }
 
+// with one constant operand, the binary ops become the scalar ones (the constant moves into
+// imm) or disappear: x+0, x-0, x*1 are x, and x*0 is the constant 0 (even for inf/nan x)
+Value *add(Value *self, Value *other) {
+    if (is_const(self) && !is_const(other)) return add_scalar(other, self->data);
+    if (is_const(other) && !is_const(self)) return add_scalar(self, other->data);
+    return new_op(self->data + other->data, self, other, 0.0, add_backward);
+}
+
 Value *sub(Value *self, Value *other) {
-    Value *out = new_val(self->data - other->data, self, other);
-    out->grad_fn = sub_backward;
-    return out;
+    if (is_const(other) && !is_const(self)) return add_scalar(self, -other->data);
+    return new_op(self->data - other->data, self, other, 0.0, sub_backward);
 }
 
 Value *mul(Value *self, Value *other) {
-    Value *out = new_val(self->data * other->data, self, other);
-    out->grad_fn = mul_backward;
-    return out;
+    if (is_const(self) && !is_const(other)) return mul_scalar(other, self->data);
+    if (is_const(other) && !is_const(self)) return mul_scalar(self, other->data);
+    return new_op(self->data * other->data, self, other, 0.0, mul_backward);
 }
 
 Value *true_div(Value *self, Value *other) {
-    Value *out = new_val(self->data / other->data, self, other);
-    out->grad_fn = div_backward;
-    return out;
+    return new_op(self->data / other->data, self, other, 0.0, div_backward);
+}
+
+// scalar ops keep the constant in out->imm instead of recording a constant leaf,
+// so `x + 3` costs one tape slot (and one backward call) instead of two
+Value *add_scalar(Value *self, float c) {
+    if (c == 0) return self;
+    return new_op(self->data + c, self, NULL, c, add_scalar_backward);
+}
+
+Value *mul_scalar(Value *self, float c) {
+    if (c == 1) return self;
+    if (c == 0) return new_const(0.0);
+    return new_op(self->data * c, self, NULL, c, mul_scalar_backward);
 }
 
 Value *v_pow(Value *self, float n) { // Value to a scalar power
-    Value *exponent = new_val(n, NULL, NULL);
-    Value *out = new_val(pow(self->data, n), self, exponent);
-    out->grad_fn = pow_backward;
-    return out;
+    if (n == 1) return self;
+    if (n == 0) return new_const(1.0);
+    return new_op(pow(self->data, n), self, NULL, n, pow_backward);
 }
 
 // idea: a/b = a*(b**-1)
@@ -130,29 +686,538 @@ Value *v_div(Value *self, Value *other) {
 
 Value *v_exp(Value *self) {
     float x = self->data;
-    Value *out = new_val(exp(x), self, NULL);
-    out->grad_fn = exp_backward;
-    return out;
+    return new_op(exp(x), self, NULL, 0.0, exp_backward);
 }
 
+// rational approximation of tanh (odd 13th / even 6th degree polynomials), clamped to
+// +-7.9053 where tanh(x) rounds to +-1 in float. max abs error vs tanh is < 5e-7
+#define TANH_CLAMP 7.90531110763549805f
+#define TANH_A13 -2.76076847742355e-16f
+#define TANH_A11 2.00018790482477e-13f
+#define TANH_A9 -8.60467152213735e-11f
+#define TANH_A7 5.12229709037114e-08f
+#define TANH_A5 1.48572235717979e-05f
+#define TANH_A3 6.37261928875436e-04f
+#define TANH_A1 4.89352455891786e-03f
+#define TANH_B6 1.19825839466702e-06f
+#define TANH_B4 1.18534705686654e-04f
+#define TANH_B2 2.26843463243900e-03f
+#define TANH_B0 4.89352518554385e-03f
+
+float fast_tanhf(float x) {
+    x = (x < -TANH_CLAMP) ? -TANH_CLAMP : x;
+    x = (x > TANH_CLAMP) ? TANH_CLAMP : x;
+    float x2 = x * x;
+    float p = TANH_A13;
+    p = p * x2 + TANH_A11;
+    p = p * x2 + TANH_A9;
+    p = p * x2 + TANH_A7;
+    p = p * x2 + TANH_A5;
+    p = p * x2 + TANH_A3;
+    p = p * x2 + TANH_A1;
+    float q = TANH_B6;
+    q = q * x2 + TANH_B4;
+    q = q * x2 + TANH_B2;
+    q = q * x2 + TANH_B0;
+    return (p * x) / q;
+}
+
+// same approximation as fast_tanhf, 4 lanes at a time (bitwise identical results)
+void fast_tanh_array(const float *x, float *y, int n) {
+    int i = 0;
+#ifdef __SSE2__
+    const __m128 lo = _mm_set1_ps(-TANH_CLAMP);
+    const __m128 hi = _mm_set1_ps(TANH_CLAMP);
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(x + i), lo), hi);
+        __m128 v2 = _mm_mul_ps(v, v);
+        __m128 p = _mm_set1_ps(TANH_A13);
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A11));
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A9));
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A7));
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A5));
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A3));
+        p = _mm_add_ps(_mm_mul_ps(p, v2), _mm_set1_ps(TANH_A1));
+        __m128 q = _mm_set1_ps(TANH_B6);
+        q = _mm_add_ps(_mm_mul_ps(q, v2), _mm_set1_ps(TANH_B4));
+        q = _mm_add_ps(_mm_mul_ps(q, v2), _mm_set1_ps(TANH_B2));
+        q = _mm_add_ps(_mm_mul_ps(q, v2), _mm_set1_ps(TANH_B0));
+        _mm_storeu_ps(y + i, _mm_div_ps(_mm_mul_ps(p, v), q));
+    }
+#endif
+    for (; i < n; i++) {
+        y[i] = fast_tanhf(x[i]);
+    }
+}
+
+// build with -DMICROGRAD_FAST_TANH to trade the last few ulps for the polynomial above
 Value *v_tanh(Value *self) {
     float x = self->data;
-    Value *out = new_val((exp(2*x)-1)/(exp(2*x)+1), self, NULL);
-    out->grad_fn = tanh_backward;
-    return out;
+#ifdef MICROGRAD_FAST_TANH
+    return new_op(fast_tanhf(x), self, NULL, 0.0, tanh_backward);
+#else
+    return new_op(tanhf(x), self, NULL, 0.0, tanh_backward);
+#endif
 }
 
 Value *relu(Value *self) {
     float x = self->data;
     float y = (x > 0) ? x : 0;
-    Value *out = new_val(y, self, NULL);
-    out->grad_fn = relu_backward;
+    return new_op(y, self, NULL, 0.0, relu_backward);
+}
+
+Value *leaky_relu(Value *self) {
+    float x = self->data;
+    return new_op((x > 0) ? x : LEAKY_RELU_SLOPE * x, self, NULL, 0.0, leaky_relu_backward);
+}
+
+// one node instead of the 4 it takes to build 1/(1+exp(-x)) out of v_exp/add/true_div
+// only ever exponentiate a non-positive number, so large |x| can't overflow
+static float sigmoidf(float x) {
+    if (x >= 0) {
+        return 1.0f / (1.0f + expf(-x));
+    }
+    float e = expf(x);
+    return e / (1.0f + e);
+}
+
+Value *v_sigmoid(Value *self) {
+    return new_op(sigmoidf(self->data), self, NULL, 0.0, sigmoid_backward);
+}
+
+static float gelu_inner(float x) {
+    return GELU_K * (x + GELU_C * x * x * x);
+}
+
+// the inner tanh of the batched GELU, forward and backward through the same tanh
+static float gelu_tanh(float x) {
+#ifdef MICROGRAD_FAST_TANH
+    return fast_tanhf(gelu_inner(x));
+#else
+    return tanhf(gelu_inner(x));
+#endif
+}
+
+// tanh approximation of GELU: 0.5x(1 + tanh(sqrt(2/pi)(x + 0.044715x^3)))
+Value *v_gelu(Value *self) {
+    float x = self->data;
+    float t = tanhf(gelu_inner(x));
+    // backward needs the inner tanh, keep it in imm instead of recomputing
+    return new_op(0.5f * x * (1 + t), self, NULL, t, gelu_backward);
+}
+
+Value *v_log(Value *self) {
+    return new_op(logf(self->data), self, NULL, 0.0, log_backward);
+}
+
+Value *v_sqrt(Value *self) {
+    return new_op(sqrtf(self->data), self, NULL, 0.0, sqrt_backward);
+}
+
+// scratch floats for the batched activation, grown on demand and never shrunk
+static float *act_scratch = NULL;
+static int act_scratch_cap = 0;
+
+static float *scratch_floats(int n) {
+    if (n > act_scratch_cap) {
+        act_scratch = realloc(act_scratch, n * sizeof(float));
+        act_scratch_cap = n;
+    }
+    return act_scratch;
+}
+
+static void tanh_inplace(float *buf, int n) {
+#ifdef MICROGRAD_FAST_TANH
+    fast_tanh_array(buf, buf, n);
+#else
+    for (int i=0; i<n; i++) buf[i] = tanhf(buf[i]);
+#endif
+}
+
+// maps pre-activations to activations in place, the whole array at once
+void activation_forward(float *buf, int n, Activation act) {
+    switch (act) {
+        case ACT_NONE:
+            break;
+        case ACT_TANH:
+            tanh_inplace(buf, n);
+            break;
+        case ACT_RELU:
+            for (int i=0; i<n; i++) buf[i] = (buf[i] > 0) ? buf[i] : 0;
+            break;
+        case ACT_LEAKY_RELU:
+            for (int i=0; i<n; i++) buf[i] = (buf[i] > 0) ? buf[i] : LEAKY_RELU_SLOPE * buf[i];
+            break;
+        case ACT_SIGMOID:
+            for (int i=0; i<n; i++) buf[i] = sigmoidf(buf[i]);
+            break;
+        case ACT_GELU:
+            for (int i=0; i<n; i++) {
+                float x = buf[i];
+                buf[i] = 0.5f * x * (1 + gelu_tanh(x));
+            }
+            break;
+    }
+}
+
+// local derivative of the activation, from its output y (and input x where the output isn't enough)
+static float activation_grad(Activation act, float y, float x) {
+    switch (act) {
+        case ACT_TANH: return 1 - y * y;
+        case ACT_RELU: return (y > 0) ? 1.0f : 0.0f;
+        case ACT_LEAKY_RELU: return (y > 0) ? 1.0f : LEAKY_RELU_SLOPE;
+        case ACT_SIGMOID: return y * (1 - y);
+        case ACT_GELU: {
+            float t = gelu_tanh(x);
+            return 0.5f * (1 + t) + 0.5f * x * (1 - t * t) * GELU_K * (1 + 3 * GELU_C * x * x);
+        }
+        case ACT_NONE: break;
+    }
+    return 1.0f;
+}
+
+// applies `act` to every x[i] in one pass and replaces x[i] with the activated node.
+// the switch happens once per call instead of an indirect call per element, and the
+// math runs over a flat float array so it can be vectorized (see fast_tanh_array).
+// every output is still its own node, so backward is unchanged
+Value **activate(Value **x, int n, Activation act) {
+    if (act == ACT_NONE) return x;
+
+    float *buf = scratch_floats(n);
+    for (int i=0; i<n; i++) {
+        buf[i] = x[i]->data;
+    }
+
+    void (*grad_fn)(Value *self, Value *prev[2]) = NULL;
+    switch (act) {
+        case ACT_TANH: grad_fn = tanh_backward; break;
+        case ACT_RELU: grad_fn = relu_backward; break;
+        case ACT_LEAKY_RELU: grad_fn = leaky_relu_backward; break;
+        case ACT_SIGMOID: grad_fn = sigmoid_backward; break;
+        case ACT_GELU: grad_fn = gelu_backward; break;
+        case ACT_NONE: break;
+    }
+
+    if (act == ACT_GELU) {
+        // gelu_backward wants the inner tanh, so buf holds that and the output is finished below
+        for (int i=0; i<n; i++) buf[i] = gelu_inner(buf[i]);
+        tanh_inplace(buf, n);
+    } else {
+        activation_forward(buf, n, act);
+    }
+
+    for (int i=0; i<n; i++) {
+        if (act == ACT_GELU) {
+            x[i] = new_op(0.5f * x[i]->data * (1 + buf[i]), x[i], NULL, buf[i], grad_fn);
+        } else {
+            x[i] = new_op(buf[i], x[i], NULL, 0.0, grad_fn);
+        }
+    }
+    return x;
+}
+
+// a fused dense layer, out = act(W x + b), recorded as one group of nout consecutive
+// tape nodes. out[0] carries the whole backward kernel; out[1..nout-1] only hold their
+// data and grad (and point back at out[0] so a DFS still finds the kernel).
+// each output keeps its pre-activation in imm, nothing else is stored per neuron
+typedef struct Dense {
+    int nin;
+    int nout;
+    Activation act;
+    Value **w; // nout x nin, row-major. owned by the caller and must outlive the tape
+    Value **b; // nout
+    Value **x; // nin, copied into the arena since callers reuse their input buffers
+    const float *xf; // or: nin raw floats read in place (dense_f), which get no gradient
+    bool input_grads; // false when no input wants a gradient (dense_f, no-grad placeholders)
+} Dense;
+
+static void dense_out_backward(Value *self, Value *prev[2]) {
+    // nothing to do, out[0] handles the whole layer once all outputs have their grads
+}
+
+// rows j0..j1-1 of a dense layer's backward. row j only touches b[j] and row j of w, so
+// disjoint row ranges can run at the same time; the input grads are shared by every row
+static void dense_rows(Value *self, int j0, int j1) {
+    Dense *d = self->ctx;
+    GradBuffer *gb = grad_buffer;
+    for (int j=j0; j<j1; j++) {
+        Value *o = self + j;
+        float g = o->grad * activation_grad(d->act, o->data, o->imm);
+        if (g == 0) continue; // dead relu units (or unused outputs) cost nothing
+        Value **wj = d->w + j * d->nin;
+        if (gb != NULL) { // in a parallel level, checked once per row and not per weight
+            acc_grad(d->b[j], g);
+            for (int i=0; i<d->nin; i++) {
+                acc_grad(wj[i], g * (d->x != NULL ? d->x[i]->data : d->xf[i]));
+                if (d->input_grads) acc_grad(d->x[i], g * wj[i]->data);
+            }
+            continue;
+        }
+        d->b[j]->grad += g;
+        if (d->input_grads) {
+            for (int i=0; i<d->nin; i++) {
+                wj[i]->grad += g * d->x[i]->data;
+                d->x[i]->grad += g * wj[i]->data;
+            }
+        } else if (d->x != NULL) {
+            for (int i=0; i<d->nin; i++) {
+                wj[i]->grad += g * d->x[i]->data;
+            }
+        } else {
+            for (int i=0; i<d->nin; i++) {
+                wj[i]->grad += g * d->xf[i];
+            }
+        }
+    }
+}
+
+static void dense_backward(Value *self, Value *prev[2]) {
+    // the sweep reaches out[0] last (lowest tape index), so every output grad is complete
+    Dense *d = self->ctx;
+    dense_rows(self, 0, d->nout);
+}
+
+static Dense *new_dense(Value **w, Value **b, int nin, int nout, Activation act, size_t extra) {
+    Dense *d = arena_alloc(sizeof(Dense) + extra);
+    d->nin = nin;
+    d->nout = nout;
+    d->act = act;
+    d->w = w;
+    d->b = b;
+    d->x = NULL;
+    d->xf = NULL;
+    d->input_grads = false;
+    return d;
+}
+
+static Value **dense_record(Dense *d, Value **out) {
+    float *buf = scratch_floats(d->nout);
+    for (int j=0; j<d->nout; j++) {
+        Value **wj = d->w + j * d->nin;
+        float sum = d->b[j]->data;
+        if (d->x != NULL) {
+            for (int i=0; i<d->nin; i++) sum += wj[i]->data * d->x[i]->data;
+        } else {
+            for (int i=0; i<d->nin; i++) sum += wj[i]->data * d->xf[i];
+        }
+        buf[j] = sum;
+    }
+
+    out[0] = new_op(buf[0], NULL, NULL, buf[0], dense_backward);
+    out[0]->ctx = d;
+    for (int j=1; j<d->nout; j++) {
+        out[j] = new_op(buf[j], out[0], NULL, buf[j], dense_out_backward);
+    }
+
+    activation_forward(buf, d->nout, d->act);
+    for (int j=0; j<d->nout; j++) {
+        out[j]->data = buf[j];
+    }
     return out;
 }
 
+Value **dense(Value **w, Value **b, Value **x, int nin, int nout, Activation act, Value **out) {
+    Dense *d = new_dense(w, b, nin, nout, act, nin * sizeof(Value*));
+    d->x = (Value **)(d + 1);
+    for (int i=0; i<nin; i++) {
+        d->x[i] = x[i];
+        d->input_grads |= !is_const(x[i]);
+        note_input_read(x[i]);
+    }
+    return dense_record(d, out);
+}
+
+// same layer, but the inputs are plain floats (e.g. a row of an mmap'd dataset). they are
+// read in place, so `x` must stay valid until backward has run
+Value **dense_f(Value **w, Value **b, const float *x, int nin, int nout, Activation act, Value **out) {
+    Dense *d = new_dense(w, b, nin, nout, act, 0);
+    d->xf = x;
+    return dense_record(d, out);
+}
+
+// a segment of the graph that is not kept on the tape (gradient checkpointing): only its
+// nin inputs and nout outputs are recorded, as one group laid out like a dense layer.
+// when backward reaches the group, fn(arg, x, out) records the segment again on top of
+// the tape, its gradients are swept right there, and the scratch region is dropped
+typedef struct Recompute {
+    int nin;
+    int nout;
+    Value **x; // nin, in the arena
+    void (*fn)(const void *arg, Value **x, Value **out);
+    void *arg; // the caller's arg, copied into the arena
+} Recompute;
+
+static void recompute_out_backward(Value *self, Value *prev[2]) {
+    // nothing to do, out[0] recomputes the whole segment once all outputs have their grads
+}
+
+static void recompute_backward(Value *self, Value *prev[2]) {
+    Recompute *r = self->ctx;
+    TapeMark mark = tape_mark();
+
+    Value **out = arena_alloc(r->nout * sizeof(Value*));
+    r->fn(r->arg, r->x, out);
+    for (int j=0; j<r->nout; j++) {
+        out[j]->grad = self[j].grad;
+    }
+    // the inputs are all below the mark, so the sweep leaves their grads to the outer one
+    for (int i=tape_head-1; i>=mark.tape_head; i--) {
+        tape_memory[i].grad_fn(&tape_memory[i], tape_memory[i].prev);
+    }
+    tape_rewind(mark);
+}
+
+// y holds the nout output values, computed by the caller without recording anything
+Value **recompute_op(Value **x, int nin, const float *y, int nout,
+                     void (*fn)(const void *arg, Value **x, Value **out), const void *arg, size_t arg_size, Value **out) {
+    Recompute *r = arena_alloc(sizeof(Recompute) + nin * sizeof(Value*) + arg_size);
+    r->nin = nin;
+    r->nout = nout;
+    r->x = (Value **)(r + 1);
+    for (int i=0; i<nin; i++) {
+        r->x[i] = x[i];
+        note_input_read(x[i]);
+    }
+    r->fn = fn;
+    r->arg = r->x + nin;
+    memcpy(r->arg, arg, arg_size);
+
+    out[0] = new_op(y[0], NULL, NULL, 0.0, recompute_backward);
+    out[0]->ctx = r;
+    for (int j=1; j<nout; j++) {
+        out[j] = new_op(y[j], out[0], NULL, 0.0, recompute_out_backward);
+    }
+    return out;
+}
+
+// number of nodes currently recorded on the tape
+int tape_size() {
+    return tape_head;
+}
+
+// bytes the current recording occupies: the nodes plus their arena data
+size_t tape_bytes() {
+    return tape_head * sizeof(Value) + arena_head * sizeof(void*);
+}
+
+// restarts the peak_* high-water marks from the current tape
+void mg_reset_peak() {
+    peak_tape_nodes = tape_head;
+    peak_tape_bytes = tape_bytes();
+}
+
+MemStats mg_memstats() {
+    note_peak();
+    MemStats s;
+    s.tape_nodes = tape_head;
+    s.peak_tape_nodes = peak_tape_nodes;
+    s.tape_bytes = tape_bytes();
+    s.peak_tape_bytes = peak_tape_bytes;
+    s.params = param_count;
+    s.param_bytes = param_count * sizeof(Value);
+    s.mallocs = model_mallocs;
+    s.malloc_bytes = model_malloc_bytes;
+    return s;
+}
+
+static bool on_tape(Value *v) {
+    return v >= tape_memory && v < tape_memory + MAX_TAPE_SIZE;
+}
+
+// where a node went during tape_compact (map holds the new index of every live node)
+static Value *relocate(Value *v, const int *map) {
+    return (v != NULL && on_tape(v)) ? &tape_memory[map[v - tape_memory]] : v;
+}
+
+static void mark_live(Value *v, int *map) {
+    if (v != NULL && on_tape(v)) map[v - tape_memory] = 1;
+}
+
+// slides the nodes reachable from root down into a dense prefix of the tape, keeping their
+// order (so it stays topological), and returns root's new address. everything else is
+// dropped, so afterwards the linear sweep only visits live nodes, e.g. for repeated
+// backward(root, true) over a tape full of logging nodes. pointers to tape nodes held
+// outside the graph (layer output buffers, your own variables) are invalid afterwards.
+// the arena isn't compacted, only the nodes. a root off the tape (a param, or a placeholder
+// that identity folding handed back) reaches no tape node, so the whole tape is dropped
+Value *tape_compact(Value *root) {
+    int root_idx = root->tape_idx; // root's slot may be reused by the time we're done
+    note_peak(); // the uncompacted tape is the high-water mark
+    if (root_idx < 0) {
+        tape_head = 0;
+        return root;
+    }
+    int *map = calloc(tape_head, sizeof(int));
+    map[root_idx] = 1;
+    // every input sits below the node that uses it, so one pass from the top finds them all
+    for (int i=tape_head-1; i>=0; i--) {
+        if (!map[i]) continue;
+        Value *v = &tape_memory[i];
+        mark_live(v->prev[0], map);
+        mark_live(v->prev[1], map);
+        if (v->grad_fn == dense_backward) {
+            Dense *d = v->ctx;
+            for (int j=1; j<d->nout; j++) map[i + j] = 1; // the kernel reads the whole group
+            for (int k=0; d->x != NULL && k<d->nin; k++) mark_live(d->x[k], map);
+        } else if (v->grad_fn == recompute_backward) {
+            Recompute *r = v->ctx;
+            for (int j=1; j<r->nout; j++) map[i + j] = 1;
+            for (int k=0; k<r->nin; k++) mark_live(r->x[k], map);
+        }
+    }
+
+    // inputs come first, so they have already moved when a node that uses them does
+    int live = 0;
+    for (int i=0; i<tape_head; i++) {
+        if (!map[i]) continue;
+        map[i] = live;
+        Value v = tape_memory[i];
+        v.tape_idx = live;
+        v.prev[0] = relocate(v.prev[0], map);
+        v.prev[1] = relocate(v.prev[1], map);
+        if (v.grad_fn == dense_backward) {
+            Dense *d = v.ctx;
+            for (int k=0; d->x != NULL && k<d->nin; k++) d->x[k] = relocate(d->x[k], map);
+        } else if (v.grad_fn == recompute_backward) {
+            Recompute *r = v.ctx;
+            for (int k=0; k<r->nin; k++) r->x[k] = relocate(r->x[k], map);
+        }
+        tape_memory[live++] = v;
+    }
+
+    Value *new_root = &tape_memory[map[root_idx]];
+    tape_head = live;
+    free(map);
+    return new_root;
+}
+
+// the current end of the tape. everything recorded after it can be dropped with tape_rewind
+TapeMark tape_mark() {
+    TapeMark mark = {tape_head, arena_head};
+    return mark;
+}
+
+// drops every node (and its arena data) recorded since `mark`, in O(1). nodes from before
+// the mark are untouched, so a graph built before it can still be extended and backward'd,
+// as long as nothing from after the mark was fed into it
+void tape_rewind(TapeMark mark) {
+    if (mark.tape_head > tape_head || mark.arena_head > arena_head) {
+        fprintf(stderr, "Error: Rewinding to a mark past the end of the tape (was the tape freed since?)\n");
+        exit(1);
+    }
+    note_peak();
+    tape_head = mark.tape_head;
+    arena_head = mark.arena_head;
+    if (tape_head < tape_soft_limit) arm_tape_limit(); // the next recording gets its callback too
+}
+
 // "free" all values allocated "on the tape" (our big block of Value structs allocated in data segment)
 void free_vals() { 
+    note_peak();
+    tape_epoch++;
     tape_head = 0;
+    arena_head = 0;
+    arm_tape_limit();
     // that's it!
 }
 
@@ -164,47 +1229,386 @@ void free_params() {
         free(parameters_head);
         parameters_head = next;
     }
+    param_count = 0;
 }
 
 // sets the gradients of all parameters to 0
 void zero_grad() {
+    TRACE_BEGIN("zero_grad");
     Value *curr = parameters_head; 
     while (curr != NULL) {
         curr->grad = 0;
         curr= curr->next;
     }
+    TRACE_END("zero_grad");
 }
 
 // in case we want to retain graph (need to zero non-parameter values instead of just freeing them)
 void zero_grad_all() {
     zero_grad();
-    for (int i=0; i<=tape_head; i++) {
+    for (int i=0; i<tape_head; i++) {
         tape_memory[i].grad = 0;
     }
 }
 
+// the sweep is done with the recorded values, so from here on the inputs may be rebound
+static void end_backward(bool retain_graph) {
+    tape_epoch++;
+    if (!retain_graph) { // "default"
+        free_vals();
+    }
+}
+
 void backward(Value *root, bool retain_graph) {
+    TRACE_BEGIN("backward");
     root->grad = 1.0; // don't forget!
 
     // backpropagate in reverse topological order
     // WE DON'T NEED TO DO TOPOLOGICAL SORT!
     // THE TAPE DOES THIS FOR US, BECAUSE VALUES ARE STORED BY ORDER OF CREATION!
     for (int i=root->tape_idx; i>=0; i--) {
+        PROFILE_NODE(&tape_memory[i]);
         tape_memory[i].grad_fn(&tape_memory[i], tape_memory[i].prev);
     }
+    PROFILE_SWEEP_END();
 
-    if (!retain_graph) { // "default"
-        free_vals();
+    end_backward(retain_graph);
+    TRACE_END("backward");
+}
+
+// wavefront-parallel backward: nodes are grouped into levels by their longest distance
+// from the root, so nothing in a level feeds anything else in it, and each level is split
+// across a thread pool. every thread accumulates into its own GradBuffer (see acc_grad),
+// and a node's buffered grads are summed into it right before its level runs. a dense
+// layer is split by rows instead, which keeps its weight and bias grads disjoint
+#define BACKWARD_PAR_MIN_WORK 2048 // nodes (or dense multiply-adds) in a level worth waking the pool for
+
+static ThreadPool *backward_pool = NULL;
+static ParamGradMode param_grad_mode = PARAM_GRAD_BUFFERED;
+static GradBuffer *grad_buffers = NULL; // one per pool thread, kept zeroed between levels
+static int grad_buffer_nodes = 0;
+static long grad_buffer_params = 0;
+
+// scratch for the level schedule, grows with the tape
+static int *node_level = NULL;
+static int *level_start = NULL;
+static Value **level_nodes = NULL;
+static int level_cap = 0;
+
+typedef struct LevelJob {
+    Value **nodes;
+    int count;
+} LevelJob;
+
+// nthreads <= 1 makes backward_parallel the plain serial backward
+void set_backward_threads(int nthreads) {
+    if (backward_pool != NULL) {
+        for (int t=0; t<backward_pool->nthreads; t++) {
+            free(grad_buffers[t].nodes);
+            free(grad_buffers[t].params);
+        }
+        free(grad_buffers);
+        pool_stop(backward_pool);
+        backward_pool = NULL;
+        grad_buffers = NULL;
+        grad_buffer_nodes = 0;
+        grad_buffer_params = 0;
+    }
+    if (nthreads > 1) {
+        backward_pool = pool_start(nthreads);
+        grad_buffers = calloc(nthreads, sizeof(GradBuffer));
+    }
+    PROFILE_THREADS(nthreads);
+}
+
+int backward_threads() {
+    return (backward_pool != NULL) ? backward_pool->nthreads : 1;
+}
+
+// how the parallel sweeps accumulate into params: PARAM_GRAD_BUFFERED gives every thread
+// its own copy of all param grads and sums them afterwards (param_count floats per thread
+// to reduce, no matter how few were touched), PARAM_GRAD_ATOMIC adds straight into
+// param->grad with a CAS (no buffers or reduction, but threads contend on shared params).
+// tape nodes are never atomic, either way
+void set_param_grad_mode(ParamGradMode mode) {
+    param_grad_mode = mode;
+}
+
+// the buffers a pool thread accumulates into for this sweep
+static GradBuffer thread_buffer(int tid, bool own_nodes) {
+    GradBuffer b = grad_buffers[tid];
+    if (own_nodes) b.nodes = NULL;
+    if (param_grad_mode == PARAM_GRAD_ATOMIC) b.params = NULL;
+    return b;
+}
+
+static float *grow_zeroed(float *p, long old_n, long n) {
+    p = realloc(p, n * sizeof(float));
+    memset(p + old_n, 0, (n - old_n) * sizeof(float));
+    return p;
+}
+
+static void grow_grad_buffers(int nodes, long params) {
+    for (int t=0; nodes > grad_buffer_nodes && t<backward_pool->nthreads; t++) {
+        grad_buffers[t].nodes = grow_zeroed(grad_buffers[t].nodes, grad_buffer_nodes, nodes);
+    }
+    if (nodes > grad_buffer_nodes) grad_buffer_nodes = nodes;
+    for (int t=0; params > grad_buffer_params && t<backward_pool->nthreads; t++) {
+        grad_buffers[t].params = grow_zeroed(grad_buffers[t].params, grad_buffer_params, params);
+    }
+    if (params > grad_buffer_params) grad_buffer_params = params;
+}
+
+static void raise_level(Value *v, int level, int *max_level) {
+    if (v == NULL || v->tape_idx < 0) return; // params and placeholders have no level
+    if (node_level[v->tape_idx] < level) node_level[v->tape_idx] = level;
+    if (level > *max_level) *max_level = level;
+}
+
+// fills level_start/level_nodes for the nodes reachable from root and returns the number
+// of levels, or -1 when the graph can't be split (recomputed segments re-record the tape)
+// or there is nothing to split (a root off the tape, see tape_compact)
+static int schedule_levels(Value *root) {
+    int n = root->tape_idx + 1;
+    if (n <= 0) return -1;
+    if (n + 1 > level_cap) {
+        level_cap = n + 1;
+        node_level = realloc(node_level, level_cap * sizeof(int));
+        level_start = realloc(level_start, (level_cap + 1) * sizeof(int));
+        level_nodes = realloc(level_nodes, level_cap * sizeof(Value*));
+    }
+    for (int i=0; i<n; i++) node_level[i] = -1;
+    node_level[n-1] = 0;
+
+    // the tape is already in topological order, so one reverse pass settles every level
+    int max_level = 0;
+    for (int i=n-1; i>=0; i--) {
+        if (node_level[i] < 0) continue; // not reachable from root
+        Value *v = &tape_memory[i];
+        if (v->grad_fn == recompute_backward) return -1;
+        int next = node_level[i] + 1;
+        raise_level(v->prev[0], next, &max_level);
+        raise_level(v->prev[1], next, &max_level);
+        if (v->grad_fn == dense_backward) {
+            Dense *d = v->ctx;
+            for (int k=0; d->x != NULL && k<d->nin; k++) raise_level(d->x[k], next, &max_level);
+        }
+    }
+
+    int nlevels = max_level + 1;
+    memset(level_start, 0, (nlevels + 1) * sizeof(int));
+    for (int i=0; i<n; i++) {
+        if (node_level[i] >= 0) level_start[node_level[i] + 1]++;
+    }
+    for (int l=0; l<nlevels; l++) level_start[l+1] += level_start[l];
+    for (int i=n-1; i>=0; i--) { // counting sort, level_start[l] doubles as the fill cursor
+        if (node_level[i] < 0) continue;
+        int l = node_level[i];
+        level_nodes[level_start[l]++] = &tape_memory[i];
+    }
+    for (int l=nlevels; l>0; l--) level_start[l] = level_start[l-1]; // undo the cursor shift
+    level_start[0] = 0;
+    return nlevels;
+}
+
+static void level_worker(void *arg, int tid, int nthreads) {
+    LevelJob *job = arg;
+    if (tid > 0) trace_thread_name("backward");
+    TRACE_BEGIN("backward_level");
+    PROFILE_WORKER_BEGIN(tid);
+    GradBuffer own = thread_buffer(tid, false);
+    grad_buffer = &own;
+    int k0 = (long)job->count * tid / nthreads;
+    int k1 = (long)job->count * (tid + 1) / nthreads;
+    for (int k=0; k<job->count; k++) {
+        Value *v = job->nodes[k];
+        if (v->grad_fn == dense_backward) { // every thread takes a slice of every layer
+            Dense *d = v->ctx;
+            PROFILE_SLICE(v, tid == 0); // one call, whichever threads share it
+            dense_rows(v, d->nout * tid / nthreads, d->nout * (tid + 1) / nthreads);
+        } else if (k >= k0 && k < k1) {
+            PROFILE_NODE(v);
+            v->grad_fn(v, v->prev);
+        }
+    }
+    grad_buffer = NULL;
+    PROFILE_WORKER_END();
+    TRACE_END("backward_level");
+}
+
+// folds every thread's buffered grad for v into v->grad and clears the slots
+static void reduce_node(Value *v) {
+    float g = 0;
+    for (int t=0; t<backward_pool->nthreads; t++) {
+        g += grad_buffers[t].nodes[v->tape_idx];
+        grad_buffers[t].nodes[v->tape_idx] = 0;
+    }
+    v->grad += g;
+}
+
+static void reduce_params() {
+    if (param_grad_mode == PARAM_GRAD_ATOMIC) return; // already in place
+    for (Value *p = parameters_head; p != NULL; p = p->next) {
+        long slot = param_slot(p);
+        float g = 0;
+        for (int t=0; t<backward_pool->nthreads; t++) {
+            g += grad_buffers[t].params[slot];
+            grad_buffers[t].params[slot] = 0;
+        }
+        p->grad += g;
+    }
+}
+
+// same result as backward (up to float summation order). levels narrower than
+// BACKWARD_PAR_MIN_WORK run serially on the calling thread, so a narrow or small graph
+// costs one extra pass over the tape to schedule it
+void backward_parallel(Value *root, bool retain_graph) {
+    int nlevels = (backward_pool != NULL) ? schedule_levels(root) : -1;
+    if (nlevels < 0) {
+        backward(root, retain_graph);
+        return;
+    }
+    TRACE_BEGIN("backward_parallel");
+    grow_grad_buffers(root->tape_idx + 1, (param_grad_mode == PARAM_GRAD_BUFFERED) ? param_count : 0);
+    root->grad = 1.0;
+
+    bool buffered = false; // has any level left grads in the buffers yet
+    for (int l=0; l<nlevels; l++) {
+        LevelJob job = {level_nodes + level_start[l], level_start[l+1] - level_start[l]};
+        long work = 0;
+        for (int k=0; k<job.count; k++) {
+            Value *v = job.nodes[k];
+            if (buffered) reduce_node(v);
+            if (v->grad_fn == dense_backward) {
+                Dense *d = v->ctx;
+                work += (long)d->nout * d->nin;
+            } else {
+                work++;
+            }
+        }
+        if (work >= BACKWARD_PAR_MIN_WORK) {
+            PROFILE_PAUSE();
+            pool_run(backward_pool, level_worker, &job);
+            PROFILE_MERGE(backward_pool->nthreads);
+            buffered = true;
+        } else {
+            for (int k=0; k<job.count; k++) {
+                PROFILE_NODE(job.nodes[k]);
+                job.nodes[k]->grad_fn(job.nodes[k], job.nodes[k]->prev);
+            }
+        }
+    }
+    PROFILE_SWEEP_END();
+    if (buffered) reduce_params();
+
+    end_backward(retain_graph);
+    TRACE_END("backward_parallel");
+}
+
+// per-sample backward: when a loss is a sum of per-sample losses, each sample's subgraph
+// only meets the others at the shared params. the caller marks where each sample starts
+// (tape_mark() before its forward) and passes its loss; the nodes between the samples
+// (the running sum) are swept first, then every sample's range is swept concurrently,
+// writing its own tape nodes in place and its param grads into thread-local buffers
+// that are reduced at the end. no atomics, except for input placeholders
+typedef struct SampleJob {
+    const TapeMark *starts;
+    Value **losses;
+    int n;
+} SampleJob;
+
+// every input of the nodes in first..last is in the range or off the tape
+static bool sample_self_contained(int first, int last) {
+    for (int i=first; i<=last; i++) {
+        Value *v = &tape_memory[i];
+        if (v->grad_fn == recompute_backward) return false;
+        Value *in[2] = {v->prev[0], v->prev[1]};
+        for (int k=0; k<2; k++) {
+            if (in[k] != NULL && in[k]->tape_idx >= 0 && (in[k]->tape_idx < first || in[k]->tape_idx > last)) return false;
+        }
+        if (v->grad_fn == dense_backward) {
+            Dense *d = v->ctx;
+            for (int k=0; d->x != NULL && k<d->nin; k++) {
+                int idx = d->x[k]->tape_idx;
+                if (idx >= 0 && (idx < first || idx > last)) return false;
+            }
+        }
     }
+    return true;
+}
+
+static bool samples_valid(Value *root, const TapeMark *starts, Value **losses, int n) {
+    int prev_last = -1;
+    for (int s=0; s<n; s++) {
+        int first = starts[s].tape_head;
+        int last = losses[s]->tape_idx;
+        if (last < 0) return false; // a loss folded down to a param or placeholder has no range
+        if (first <= prev_last || last < first || !sample_self_contained(first, last)) return false;
+        prev_last = last;
+    }
+    return root->tape_idx > prev_last;
+}
+
+static void sample_worker(void *arg, int tid, int nthreads) {
+    SampleJob *job = arg;
+    if (tid > 0) trace_thread_name("backward");
+    TRACE_BEGIN("backward_sample");
+    PROFILE_WORKER_BEGIN(tid);
+    GradBuffer own = thread_buffer(tid, true);
+    grad_buffer = &own;
+    for (int s=tid; s<job->n; s+=nthreads) {
+        for (int i=job->losses[s]->tape_idx; i>=job->starts[s].tape_head; i--) {
+            PROFILE_NODE(&tape_memory[i]);
+            tape_memory[i].grad_fn(&tape_memory[i], tape_memory[i].prev);
+        }
+    }
+    grad_buffer = NULL;
+    PROFILE_WORKER_END();
+    TRACE_END("backward_sample");
+}
+
+// same result as backward (up to float summation order). falls back to backward when
+// there is no pool or a sample's range reads nodes outside itself
+void backward_samples(Value *root, const TapeMark *starts, Value **losses, int n, bool retain_graph) {
+    if (backward_pool == NULL || !samples_valid(root, starts, losses, n)) {
+        backward(root, retain_graph);
+        return;
+    }
+    TRACE_BEGIN("backward_samples");
+    grow_grad_buffers(0, (param_grad_mode == PARAM_GRAD_BUFFERED) ? param_count : 0);
+    root->grad = 1.0;
+
+    // the nodes outside every sample, top down, skipping over each sample's range
+    int s = n - 1;
+    for (int i=root->tape_idx; i>=0; i--) {
+        if (s >= 0 && i <= losses[s]->tape_idx) {
+            i = starts[s--].tape_head;
+            continue;
+        }
+        PROFILE_NODE(&tape_memory[i]);
+        tape_memory[i].grad_fn(&tape_memory[i], tape_memory[i].prev);
+    }
+
+    SampleJob job = {starts, losses, n};
+    PROFILE_PAUSE();
+    pool_run(backward_pool, sample_worker, &job);
+    PROFILE_MERGE(backward_pool->nthreads);
+    PROFILE_SWEEP_END();
+    reduce_params();
+
+    end_backward(retain_graph);
+    TRACE_END("backward_samples");
 }
 
 void update_params(float lr) {
+    TRACE_BEGIN("update_params");
     Value *v = parameters_head;
     while (v != NULL) {
         // gradient descent: data = data - (learning_rate * grad)
         v->data -= lr * v->grad;
         v = v->next;
     }
+    TRACE_END("update_params");
 }
 
 // the following functions are just for testing/analysis for Data Structures mini-project
@@ -216,7 +1620,7 @@ int testing() {
 
 static void build_topo(Value *v, int *visited, Value **topo, int *topo_idx) {
     // If parameter or leaf node, skip (they recieve gradients from above)
-    if (v->tape_idx < 0 || v->grad_fn == noop_backward) return;
+    if (v->tape_idx < 0 || v->grad_fn == noop_backward || is_const(v)) return;
 
     // If already visited (using unique tape_idx as the key), skip
     if (visited[v->tape_idx]) return;
@@ -228,6 +1632,14 @@ static void build_topo(Value *v, int *visited, Value **topo, int *topo_idx) {
     //       during our backwards pass, though in a forward pass they are the parents
     if (v->prev[0]) build_topo(v->prev[0], visited, topo, topo_idx);
     if (v->prev[1]) build_topo(v->prev[1], visited, topo, topo_idx);
+    if (v->grad_fn == dense_backward) { // a dense layer keeps its inputs in the arena, not in prev[]
+        Dense *d = v->ctx;
+        for (int i=0; d->x != NULL && i<d->nin; i++) build_topo(d->x[i], visited, topo, topo_idx);
+    }
+    if (v->grad_fn == recompute_backward) { // so does a recomputed segment
+        Recompute *r = v->ctx;
+        for (int i=0; i<r->nin; i++) build_topo(r->x[i], visited, topo, topo_idx);
+    }
     
     // post-order: add ourselves to the list _after_ children
     topo[*topo_idx] = v;
@@ -235,6 +1647,7 @@ static void build_topo(Value *v, int *visited, Value **topo, int *topo_idx) {
 }
 
 void backward_dfs(Value *root, bool retain_graph) {
+    TRACE_BEGIN("backward_dfs");
     int *visited = calloc(tape_head, sizeof(int)); // calloc initializes to 0
     Value **topo = malloc(tape_head * sizeof(Value*)); // at most this many nodes to process
     int topo_idx = 0; // stores the 
@@ -249,14 +1662,15 @@ void backward_dfs(Value *root, bool retain_graph) {
     for (int i = topo_idx - 1; i >= 0; i--) {
         Value *v = topo[i];
         if (v->grad_fn) {
+            PROFILE_NODE(v);
             v->grad_fn(v, v->prev);
         }
     }
+    PROFILE_SWEEP_END();
     
     // cleanup
     free(visited);
     free(topo);
-    if (!retain_graph) { // "default"
-        free_vals();
-    }
+    end_backward(retain_graph);
+    TRACE_END("backward_dfs");
 }
@@ -7,39 +7,129 @@
 #include <math.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_TAPE_SIZE 100000 // nodes
+#define MAX_ARENA_WORDS MAX_TAPE_SIZE // pointer-sized words of op-private data (see dense)
+
+#define LEAKY_RELU_SLOPE 0.01f
+
+typedef enum Activation {
+    ACT_NONE,
+    ACT_TANH,
+    ACT_RELU,
+    ACT_LEAKY_RELU,
+    ACT_SIGMOID,
+    ACT_GELU,
+} Activation;
 
 typedef struct Value {
     float data;
     float grad;
     void (*grad_fn)(struct Value *self, struct Value *prev[2]);
     struct Value *prev[2]; // 1 or 2 inputs per operation (or 0 inputs for noop)
-    int tape_idx; // so we know where to start backprop
-    struct Value *next; // for keeping track of weights allocation on heap
+    int tape_idx; // so we know where to start backprop (params: -2 - param index, input placeholders: -1)
+    float imm; // immediate scalar operand kept inside the node (exponent, constant term, ...)
+    union {
+        struct Value *next; // params: for keeping track of weights allocation on heap
+        void *ctx; // tape nodes: op-private data that lives in the tape arena (see dense)
+    };
 } Value;
 
+typedef struct MemStats {
+    int tape_nodes; // recorded right now
+    int peak_tape_nodes; // most ever recorded at once
+    size_t tape_bytes; // nodes plus their arena data, see tape_bytes
+    size_t peak_tape_bytes;
+    long params; // live parameters (until free_params)
+    size_t param_bytes;
+    long mallocs; // calls made for model storage by new_param/new_neuron/new_layer/new_mlp
+    size_t malloc_bytes;
+} MemStats;
+
+typedef struct CseStats {
+    long lookups; // ops recorded while CSE was on
+    long hits; // ...that reused an existing node instead
+    double hit_rate;
+} CseStats;
+
+typedef enum ParamGradMode {
+    PARAM_GRAD_BUFFERED, // per-thread param grad buffers, reduced after the sweep
+    PARAM_GRAD_ATOMIC, // CAS float adds straight into the params
+} ParamGradMode;
+
+typedef struct TapeMark {
+    int tape_head;
+    int arena_head;
+} TapeMark;
+
 double random_uniform(double min, double max);
+void *mg_malloc(size_t bytes);
 
 Value *new_val(float data, Value *prev0, Value *prev1);
 Value *new_param(float data);
+Value *new_const(float data);
+// the recorded nodes read a placeholder during backward, so it must not be rebound until
+// backward has run (bind_inputs exits otherwise); give each sample of a batch its own set
+Value **new_inputs(int n, bool requires_grad);
+void bind_inputs(Value **x, const float *data, int n);
+void free_inputs(Value **x);
 void print_value(Value *v);
 
 Value *add(Value *self, Value *other);
 Value *sub(Value *self, Value *other);
 Value *mul(Value *self, Value *other);
 Value *true_div(Value *self, Value *other);
+Value *add_scalar(Value *self, float c);
+Value *mul_scalar(Value *self, float c);
 Value *v_pow(Value *self, float n);
 Value *v_div(Value *self, Value *other);
 Value *v_exp(Value *self);
 Value *v_tanh(Value *self);
+float fast_tanhf(float x);
+void fast_tanh_array(const float *x, float *y, int n);
 Value *relu(Value *self);
+Value *leaky_relu(Value *self);
+Value *v_sigmoid(Value *self);
+Value *v_gelu(Value *self);
+Value *v_log(Value *self);
+Value *v_sqrt(Value *self);
+void activation_forward(float *buf, int n, Activation act);
+Value **activate(Value **x, int n, Activation act);
+Value **dense(Value **w, Value **b, Value **x, int nin, int nout, Activation act, Value **out);
+Value **dense_f(Value **w, Value **b, const float *x, int nin, int nout, Activation act, Value **out);
+Value **recompute_op(Value **x, int nin, const float *y, int nout,
+                     void (*fn)(const void *arg, Value **x, Value **out), const void *arg, size_t arg_size, Value **out);
+
+void cse_enable(bool on);
+CseStats cse_stats();
+void cse_reset_stats();
 
 void backward(Value *root, bool retain_graph);
+void set_backward_threads(int nthreads);
+int backward_threads();
+void set_param_grad_mode(ParamGradMode mode);
+void backward_parallel(Value *root, bool retain_graph);
+void backward_samples(Value *root, const TapeMark *starts, Value **losses, int n, bool retain_graph);
 void update_params(float lr);
 
+int tape_size();
+size_t tape_bytes();
 void free_vals();
+Value *tape_compact(Value *root);
+TapeMark tape_mark();
+void tape_rewind(TapeMark mark);
 void free_params();
 void zero_grad();
 void zero_grad_all();
+MemStats mg_memstats();
+void mg_reset_peak();
+void mg_set_tape_limit(int nodes, void (*on_limit)(MemStats *stats, void *arg), void *arg);
+
+// per-op node counts and backward time, only collected when built with -DMICROGRAD_PROFILE
+void profile_reset();
+void profile_report(FILE *f);
+void profile_report_json(FILE *f);
 
 int testing();
 void backward_dfs(Value *root, bool retain_graph);
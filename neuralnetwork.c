@@ -1,66 +1,62 @@
-#include "micrograd.h"
+#include <sys/mman.h>
+#include "neuralnetwork.h"
+#include "trace.h"
 
-typedef struct Neuron {
-    int nin;
-    Value **weights;
-    Value *bias;
+Neuron *new_neuron(int nin) {
+    Neuron *n = mg_malloc(sizeof(Neuron));
 
-    Value *output; // just for potential debug
-    Value* (*activation)(Value *self);
-} Neuron;
-
-typedef struct Layer {
-    int nin;
-    int nout;
-    Neuron **neurons;
-    Value **output_buffer;
-} Layer;
-
-typedef struct MLP {
-    int nlayers;
-    Layer **layers;
-} MLP;
-
-Neuron *new_neuron(int nin, Value* (*activation)(Value *self)) {
-    Neuron *n = malloc(sizeof(Neuron));
-
-    n->weights = malloc(nin*sizeof(Value*));
+    n->weights = mg_malloc(nin*sizeof(Value*));
     for (int i = 0; i < nin; i++) {
         n->weights[i] = new_param(random_uniform(-0.5,0.5));
     }
     n->nin= nin;
     n->bias = new_param(0);
 
-    n->activation = activation;
-
     return n;
 }
 
-Layer *new_layer(int nin, int nout, Value* (*activation)(Value *self)) {
-    Layer *l = malloc(sizeof(Layer));
+Layer *new_layer(int nin, int nout, Activation activation) {
+    Layer *l = mg_malloc(sizeof(Layer));
 
-    l->neurons = malloc(nout*sizeof(Neuron*));
-    l->output_buffer = malloc(nout*sizeof(Value*));
+    l->neurons = mg_malloc(nout*sizeof(Neuron*));
+    l->weights = mg_malloc(nout*nin*sizeof(Value*));
+    l->biases = mg_malloc(nout*sizeof(Value*));
+    l->output_buffer = mg_malloc(nout*sizeof(Value*));
     for (int i = 0; i < nout; i++) {
-        l->neurons[i] = new_neuron(nin, activation);
+        l->neurons[i] = new_neuron(nin);
+        for (int j = 0; j < nin; j++) {
+            l->weights[i*nin + j] = l->neurons[i]->weights[j];
+        }
+        l->biases[i] = l->neurons[i]->bias;
     }
     l->nin = nin;
     l->nout = nout;
+    l->activation = activation;
 
     return l;
 }
 
-MLP *new_mlp(int inputdim, int nlayers, int *layerdims) {
-    MLP *mlp = malloc(sizeof(MLP));
-    mlp->layers = malloc(nlayers*sizeof(Layer*));
+// activations[i] is used for layer i; pass NULL for the default of tanh on the
+// hidden layers and a linear output layer
+MLP *new_mlp(int inputdim, int nlayers, int *layerdims, Activation *activations) {
+    MLP *mlp = mg_malloc(sizeof(MLP));
+    mlp->layers = mg_malloc(nlayers*sizeof(Layer*));
     mlp->nlayers = nlayers;
+    mlp->blob = NULL;
+    mlp->map = NULL;
+    mlp->map_size = 0;
 
     int nin, nout;
     for (int i=0; i<nlayers; i++) {
         nin = (i == 0) ? inputdim : layerdims[i-1];
         nout = layerdims[i];
 
-        Value* (*activation)(Value *self) = (i == nlayers-1) ? NULL : v_tanh;
+        Activation activation;
+        if (activations != NULL) {
+            activation = activations[i];
+        } else {
+            activation = (i == nlayers-1) ? ACT_NONE : ACT_TANH;
+        }
 
         mlp->layers[i] = new_layer(nin, nout, activation);
     }
@@ -73,9 +69,9 @@ MLP *new_mlp(int inputdim, int nlayers, int *layerdims) {
 // w[2]*x[2] -->      +      ^--> sum
 // w[3]*x[3] -->         +         ^--> sum
 //       bias-->            +            ^--> output
-//       (if activation_func!=NULL)              ^-->activation(output) --> ouput
+// (the activation is applied by layer_forward_unfused, for the whole layer at once)
 Value* neuron_forward(Neuron *n, Value **x) {
-    Value *sum = new_val(0, NULL, NULL);
+    Value *sum = new_const(0); // the first add folds away
     Value *wixi;
     for (int i=0; i<n->nin; i++) {
         wixi = mul(n->weights[i], x[i]);
@@ -84,42 +80,172 @@ Value* neuron_forward(Neuron *n, Value **x) {
     
     n->output = add(sum, n->bias);
 
-    if (n->activation != NULL) {
-        n->output = n->activation(n->output);
-    }
-
     return n->output;
 }
 
-Value** layer_forward(Layer *l, Value **x) {
+// the unfused version of a layer: nout*(2*nin+1) nodes, then nout activation nodes
+Value** layer_forward_unfused(Layer *l, Value **x) {
+    TRACE_BEGIN("layer_forward_unfused");
     for (int i=0; i<l->nout; i++) {
         l->output_buffer[i] = neuron_forward(l->neurons[i], x);
     }
-    return l->output_buffer;
+    Value **out = activate(l->output_buffer, l->nout, l->activation);
+    TRACE_END("layer_forward_unfused");
+    return out;
+}
+
+// one fused dense op: nout nodes total, with a single backward kernel for the layer
+Value** layer_forward(Layer *l, Value **x) {
+    TRACE_BEGIN("layer_forward");
+    Value **out = dense(l->weights, l->biases, x, l->nin, l->nout, l->activation, l->output_buffer);
+    TRACE_END("layer_forward");
+    return out;
 }
 
 Value** forward(MLP *mlp, Value **inputs) {
+    TRACE_BEGIN("forward");
     for (int i=0; i<mlp->nlayers; i++) {
         inputs = layer_forward(mlp->layers[i], inputs);
     }
+    TRACE_END("forward");
     return inputs;
 }
 
-void free_mlp(MLP *mlp) {
+// same as forward, but the input is a plain float array (e.g. dataset_row) that the first
+// layer reads in place: no input nodes are created and nothing is copied
+Value** forward_input(MLP *mlp, const float *x) {
+    TRACE_BEGIN("forward");
+    Layer *first = mlp->layers[0];
+    TRACE_BEGIN("layer_forward");
+    Value **out = dense_f(first->weights, first->biases, x, first->nin, first->nout, first->activation, first->output_buffer);
+    TRACE_END("layer_forward");
+    for (int i=1; i<mlp->nlayers; i++) {
+        out = layer_forward(mlp->layers[i], out);
+    }
+    TRACE_END("forward");
+    return out;
+}
+
+// one layer on plain floats: out = act(W in + b), with the params read from the blob
+// slice p when it isn't NULL, otherwise from the Value params
+static void layer_predict(Layer *l, const float *p, const float *in, float *out) {
+    for (int j=0; j<l->nout; j++) {
+        float sum;
+        if (p != NULL) {
+            const float *wj = p + j * l->nin;
+            sum = p[l->nout * l->nin + j];
+            for (int k=0; k<l->nin; k++) sum += wj[k] * in[k];
+        } else {
+            Value **wj = l->weights + j * l->nin;
+            sum = l->biases[j]->data;
+            for (int k=0; k<l->nin; k++) sum += wj[k]->data * in[k];
+        }
+        out[j] = sum;
+    }
+    activation_forward(out, l->nout, l->activation);
+}
+
+static int mlp_width(MLP *mlp) {
+    int width = mlp->layers[0]->nin;
+    for (int i=0; i<mlp->nlayers; i++) {
+        if (mlp->layers[i]->nout > width) width = mlp->layers[i]->nout;
+    }
+    return width;
+}
+
+// inference without the tape: y = mlp(x) computed on plain floats. reads the params from
+// the mapped blob when there is one, otherwise from the Value params
+void mlp_predict(MLP *mlp, const float *x, float *y) {
+    float buf[2][mlp_width(mlp)];
+
+    const float *p = mlp->blob;
+    const float *in = x;
     for (int i=0; i<mlp->nlayers; i++) {
         Layer *l = mlp->layers[i];
-        for (int j=0; j<l->nout; j++) {
-            Neuron *n = l->neurons[j];
-            // note that we don't free any internal value structs here:
-            // - vals: live "on the tape"!
-            // - params: in the heap, but tracked by parameters_head
-            // ...so we keep track of these separately and deal with them below
-            free(n->weights);
-            free(n);
+        float *out = (i == mlp->nlayers-1) ? y : buf[i % 2];
+        layer_predict(l, p, in, out);
+        if (p != NULL) p += l->nout * l->nin + l->nout;
+        in = out;
+    }
+}
+
+// layers first..last of an MLP, recorded as one recompute_op by forward_checkpointed
+typedef struct Segment {
+    MLP *mlp;
+    int first;
+    int last;
+} Segment;
+
+static void segment_recompute(const void *arg, Value **x, Value **out) {
+    const Segment *s = arg;
+    TRACE_BEGIN("segment_recompute");
+    for (int i=s->first; i<=s->last; i++) {
+        Layer *l = s->mlp->layers[i];
+        x = dense(l->weights, l->biases, x, l->nin, l->nout, l->activation, (i == s->last) ? out : l->output_buffer);
+    }
+    TRACE_END("segment_recompute");
+}
+
+// forward with gradient checkpointing: the layers are cut into segments of segment_layers
+// (0 for sqrt(nlayers)), and only the activations at segment boundaries are recorded.
+// backward runs each segment's forward again on top of the tape and drops it right
+// after, so it costs about one more forward pass but the tape holds nlayers/segment_layers
+// boundaries plus one live segment instead of every layer
+Value** forward_checkpointed(MLP *mlp, Value **inputs, int segment_layers) {
+    TRACE_BEGIN("forward");
+    if (segment_layers <= 0) segment_layers = (int)ceil(sqrt(mlp->nlayers));
+    int width = mlp_width(mlp);
+    float buf[3][width];
+
+    Value **x = inputs;
+    for (int first=0; first<mlp->nlayers; first+=segment_layers) {
+        int last = (first + segment_layers < mlp->nlayers) ? first + segment_layers - 1 : mlp->nlayers - 1;
+        TRACE_BEGIN("layer_forward");
+        float *in = buf[2];
+        for (int k=0; k<mlp->layers[first]->nin; k++) in[k] = x[k]->data;
+        for (int i=first; i<=last; i++) {
+            float *out = buf[i % 2];
+            layer_predict(mlp->layers[i], NULL, in, out);
+            in = out;
         }
-        free(l->neurons);
-        free(l->output_buffer);
-        free(l);
+        Segment s = {mlp, first, last};
+        Layer *l = mlp->layers[last];
+        x = recompute_op(x, mlp->layers[first]->nin, in, l->nout, segment_recompute, &s, sizeof(s), l->output_buffer);
+        TRACE_END("layer_forward");
+    }
+    TRACE_END("forward");
+    return x;
+}
+
+// params live on until free_params(), see free_mlp
+void free_layer(Layer *l) {
+    for (int j=0; j<l->nout; j++) {
+        Neuron *n = l->neurons[j];
+        // note that we don't free any internal value structs here:
+        // - vals: live "on the tape"!
+        // - params: in the heap, but tracked by parameters_head
+        // ...so we keep track of these separately and deal with them in free_mlp
+        free(n->weights);
+        free(n);
+    }
+    free(l->neurons);
+    free(l->weights);
+    free(l->biases);
+    free(l->output_buffer);
+    free(l);
+}
+
+void free_mlp(MLP *mlp) {
+    if (mlp->map != NULL) { // mapped checkpoint: the layers are only shapes, nothing on the tape or heap
+        munmap(mlp->map, mlp->map_size);
+        free(mlp->layers[0]); // the shapes are one array, see mlp_load_mapped
+        free(mlp->layers);
+        free(mlp);
+        return;
+    }
+
+    for (int i=0; i<mlp->nlayers; i++) {
+        free_layer(mlp->layers[i]);
     }
     free(mlp->layers);
     free(mlp);
@@ -127,4 +253,3 @@ void free_mlp(MLP *mlp) {
     free_vals(); // just sets index pointer (tape_head) back to 0
     free_params(); // traverses linked list and frees all weights and biases
 }
-
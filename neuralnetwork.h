@@ -7,30 +7,43 @@ typedef struct Neuron {
     int nin;
     Value **weights;
     Value *bias;
-    Value *output; // just for potential debug
-    Value* (*activation)(Value *self);
+    Value *output; // just for potential debug (pre-activation)
 } Neuron;
 
 typedef struct Layer {
     int nin;
     int nout;
     Neuron **neurons;
+    Value **weights; // nout x nin view of the neurons' weights, row-major (for dense)
+    Value **biases;
     Value **output_buffer;
+    Activation activation; // applied to the whole layer output in one batch
 } Layer;
 
 typedef struct MLP {
     int nlayers;
     Layer **layers;
+    // set by mlp_load_mapped: the parameters are read straight out of a mapped checkpoint
+    // (per layer: weights row-major, then biases), and the layers have no Value params,
+    // so the model can only run mlp_predict
+    const float *blob;
+    void *map;
+    size_t map_size;
 } MLP;
 
-Neuron *new_neuron(int nin, Value* (*activation)(Value *self));
-Layer *new_layer(int nin, int nout, Value* (*activation)(Value *self));
-MLP *new_mlp(int inputdim, int nlayers, int *layerdims);
+Neuron *new_neuron(int nin);
+Layer *new_layer(int nin, int nout, Activation activation);
+MLP *new_mlp(int inputdim, int nlayers, int *layerdims, Activation *activations);
 
 Value* neuron_forward(Neuron *n, Value **x);
 Value** layer_forward(Layer *l, Value **x);
+Value** layer_forward_unfused(Layer *l, Value **x);
 Value** forward(MLP *mlp, Value **inputs);
+Value** forward_input(MLP *mlp, const float *x);
+Value** forward_checkpointed(MLP *mlp, Value **inputs, int segment_layers);
+void mlp_predict(MLP *mlp, const float *x, float *y);
 
+void free_layer(Layer *l);
 void free_mlp(MLP *mlp);
 
 #endif // NEURALNETWORK_H
@@ -0,0 +1,107 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfcount.h"
+
+const char *perf_event_names[PERF_NEVENTS] = {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+static const struct { uint32_t type; uint64_t config; } perf_events[PERF_NEVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, // last level cache
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int open_counter(PerfEvent e) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[e].type;
+    attr.config = perf_events[e].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1; // allowed at perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    // when there are more counters than the PMU has slots, they are time-multiplexed and
+    // these let us scale the counts back up
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// never NULL, check navailable (or perf_available) to see what is actually counted
+PerfCounters *perf_open() {
+    PerfCounters *pc = calloc(1, sizeof(PerfCounters));
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        pc->fd[e] = open_counter(e);
+        if (pc->fd[e] >= 0) pc->navailable++;
+        else if (pc->open_errno == 0) pc->open_errno = errno;
+    }
+    return pc;
+}
+
+void perf_close(PerfCounters *pc) {
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (pc->fd[e] >= 0) close(pc->fd[e]);
+    }
+    free(pc);
+}
+
+bool perf_available(PerfCounters *pc, PerfEvent e) {
+    return pc->fd[e] >= 0;
+}
+
+void perf_reset(PerfCounters *pc) {
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (pc->fd[e] >= 0) ioctl(pc->fd[e], PERF_EVENT_IOC_RESET, 0);
+        pc->value[e] = 0;
+    }
+    pc->nodes = 0;
+}
+
+void perf_begin(PerfCounters *pc) {
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (pc->fd[e] >= 0) ioctl(pc->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// stops the counters and brings value[] up to date
+void perf_end(PerfCounters *pc) {
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (pc->fd[e] >= 0) ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        uint64_t buf[3]; // value, time enabled, time running
+        if (pc->fd[e] < 0 || read(pc->fd[e], buf, sizeof(buf)) != sizeof(buf)) continue;
+        pc->value[e] = (buf[2] > 0 && buf[2] < buf[1]) ? (uint64_t)((double)buf[0] * buf[1] / buf[2]) : buf[0];
+    }
+}
+
+// backward_fn (backward or backward_dfs) with the counters running. the sweep covers
+// everything up to root, so that's what it is charged per node for
+void perf_backward(PerfCounters *pc, void (*backward_fn)(Value *root, bool retain_graph), Value *root, bool retain_graph) {
+    pc->nodes += root->tape_idx + 1;
+    perf_begin(pc);
+    backward_fn(root, retain_graph);
+    perf_end(pc);
+}
+
+// one line: every counter divided by `nodes` (pass pc->nodes after perf_backward, or the
+// number of nodes the measured region swept in total)
+void perf_report(FILE *f, PerfCounters *pc, const char *label, long nodes) {
+    if (pc->navailable == 0) {
+        fprintf(f, "%-44s hardware counters unavailable (%s)\n", label, strerror(pc->open_errno));
+        return;
+    }
+    fprintf(f, "%-44s", label);
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (pc->fd[e] >= 0) fprintf(f, " %s/node %.2f", perf_event_names[e], (double)pc->value[e] / (nodes ? nodes : 1));
+        else fprintf(f, " %s n/a", perf_event_names[e]);
+    }
+    if (pc->fd[PERF_CYCLES] >= 0 && pc->fd[PERF_INSTRUCTIONS] >= 0 && pc->value[PERF_CYCLES] > 0) {
+        fprintf(f, " ipc %.2f", (double)pc->value[PERF_INSTRUCTIONS] / pc->value[PERF_CYCLES]);
+    }
+    fprintf(f, "\n");
+}
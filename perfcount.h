@@ -0,0 +1,40 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "micrograd.h"
+
+// hardware counters via perf_event_open (user space only, this process only). every
+// counter is opened on its own, so one the CPU or VM doesn't have just reads as
+// unavailable instead of taking the others down with it; with no PMU at all (or
+// perf_event_paranoid too high) everything is unavailable and the calls are no-ops
+typedef enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NEVENTS,
+} PerfEvent;
+
+extern const char *perf_event_names[PERF_NEVENTS];
+
+typedef struct PerfCounters {
+    int fd[PERF_NEVENTS]; // -1 where the counter couldn't be opened
+    uint64_t value[PERF_NEVENTS]; // totals over every perf_begin/perf_end pair so far
+    long nodes; // tape nodes swept under perf_backward
+    int navailable;
+    int open_errno; // why the first unavailable counter failed
+} PerfCounters;
+
+PerfCounters *perf_open();
+void perf_close(PerfCounters *pc);
+void perf_reset(PerfCounters *pc);
+void perf_begin(PerfCounters *pc);
+void perf_end(PerfCounters *pc);
+bool perf_available(PerfCounters *pc, PerfEvent e);
+void perf_backward(PerfCounters *pc, void (*backward_fn)(Value *root, bool retain_graph), Value *root, bool retain_graph);
+void perf_report(FILE *f, PerfCounters *pc, const char *label, long nodes);
+
+#endif // PERFCOUNT_H
@@ -1,9 +1,18 @@
 #include <stdio.h>
-#include <time.h>
 #include <math.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include "micrograd.h"
 #include "neuralnetwork.h"
+#include "dataset.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "perfcount.h"
 
 // --- Helpers ---
 int is_close(float a, float b) {
@@ -62,128 +71,1196 @@ void test_activation() {
     free_vals();
 }
 
-// --- Analysis & Benchmarks ---
+void test_scalar_ops() {
+    printf("[TEST] Scalar-Immediate Ops... ");
 
-void benchmark_model(int input_dim, int hidden_dim, int runs, char *label) {
-    printf("[BENCHMARK] %s (Input: %d, Hidden: %d, Output: 10)\n", label, input_dim, hidden_dim);
-    
-    int nlayers = 3;
-    int layerdims[] = {hidden_dim, hidden_dim, 10};
-    MLP *mlp = new_mlp(input_dim, nlayers, layerdims);
-    
-    // Dummy inputs
-    Value *x[input_dim];
-    for(int i=0; i<input_dim; i++) x[i] = new_val(0.1f, NULL, NULL);
-    
-    clock_t start = clock();
-    
-    for(int i=0; i<runs; i++) {
-        // Create fresh inputs on tape every step (simulating real training)
-        for(int j=0; j<input_dim; j++) x[j] = new_val(0.1f, NULL, NULL);
-        
-        Value **out = forward(mlp, x);
+    // f = 3*a + (-5) + a^2, a=2 -> f = 6 - 5 + 4 = 5
+    Value *a = new_val(2.0, NULL, NULL);
+    Value *three_a = mul_scalar(a, 3);
+    Value *shifted = add_scalar(three_a, -5);
+    Value *sq = v_pow(a, 2);
+    Value *f = add(shifted, sq);
+    assert(is_close(f->data, 5.0));
+
+    // constants live in the node: each op takes exactly one tape slot
+    assert(three_a->tape_idx == a->tape_idx + 1);
+    assert(sq->tape_idx == shifted->tape_idx + 1);
+    assert(sq->prev[1] == NULL);
+
+    // df/da = 3 + 2a = 7
+    backward(f, false);
+    assert(is_close(a->grad, 7.0));
+
+    // a/b = a * b^-1 -> 2 nodes, d/db = -a/b^2
+    Value *x = new_val(6.0, NULL, NULL);
+    Value *y = new_val(2.0, NULL, NULL);
+    Value *q = v_div(x, y);
+    assert(is_close(q->data, 3.0));
+    assert(q->tape_idx == y->tape_idx + 2);
+    backward(q, false);
+    assert(is_close(x->grad, 0.5));
+    assert(is_close(y->grad, -1.5));
+
+    printf("PASSED\n");
+}
+
+// compares the analytic gradient of a unary op against a central difference
+void check_unary_grad(Value* (*op)(Value *self), float x) {
+    float h = 1e-3;
+    float numeric = (op(new_val(x + h, NULL, NULL))->data - op(new_val(x - h, NULL, NULL))->data) / (2 * h);
+    free_vals();
+
+    Value *in = new_val(x, NULL, NULL);
+    backward(op(in), false);
+    assert(fabs(in->grad - numeric) < 1e-2);
+}
+
+void test_more_activations() {
+    printf("[TEST] Sigmoid, GELU, Leaky ReLU, Log, Sqrt... ");
+
+    assert(is_close(v_sigmoid(new_val(0.0, NULL, NULL))->data, 0.5));
+    assert(is_close(v_sigmoid(new_val(-100.0, NULL, NULL))->data, 0.0)); // no overflow
+    assert(is_close(v_gelu(new_val(0.0, NULL, NULL))->data, 0.0));
+    assert(is_close(v_gelu(new_val(1.0, NULL, NULL))->data, 0.841192));
+    assert(is_close(leaky_relu(new_val(-2.0, NULL, NULL))->data, -2.0 * LEAKY_RELU_SLOPE));
+    assert(is_close(v_log(new_val(M_E, NULL, NULL))->data, 1.0));
+    assert(is_close(v_sqrt(new_val(9.0, NULL, NULL))->data, 3.0));
+    free_vals();
+
+    float points[] = {-2.0, -0.3, 0.7, 2.5};
+    for (int i=0; i<4; i++) {
+        check_unary_grad(v_sigmoid, points[i]);
+        check_unary_grad(v_gelu, points[i]);
+        check_unary_grad(leaky_relu, points[i]);
+        check_unary_grad(v_tanh, points[i]);
+        check_unary_grad(v_log, fabs(points[i]));
+        check_unary_grad(v_sqrt, fabs(points[i]));
+    }
+
+    // any of them can drive the layers of an MLP
+    int layerdims[] = {3, 1};
+    Activation activations[] = {ACT_GELU, ACT_SIGMOID};
+    MLP *mlp = new_mlp(2, 2, layerdims, activations);
+    Value *x[2] = {new_val(0.5, NULL, NULL), new_val(-1.0, NULL, NULL)};
+    Value **out = forward(mlp, x);
+    zero_grad();
+    backward(out[0], false);
+    assert(mlp->layers[0]->neurons[0]->weights[0]->grad != 0);
+    free_mlp(mlp);
+
+    printf("PASSED\n");
+}
+
+void test_fast_tanh() {
+    printf("[TEST] Fast Tanh Accuracy... ");
+
+    // sweep well past the clamp point on both sides
+    enum { N = 20001 };
+    static float xs[N], ys[N];
+    for (int i=0; i<N; i++) xs[i] = -10.0f + 20.0f * i / (N - 1);
+    fast_tanh_array(xs, ys, N);
+
+    double max_err = 0;
+    for (int i=0; i<N; i++) {
+        double err = fabs(fast_tanhf(xs[i]) - tanh(xs[i]));
+        if (err > max_err) max_err = err;
+        assert(ys[i] == fast_tanhf(xs[i])); // vector and scalar paths agree exactly
+    }
+    assert(max_err < 5e-7);
+    assert(fast_tanhf(0.0f) == 0.0f);
+
+    printf("PASSED (max abs error %.2e)\n", max_err);
+}
+
+void test_activate() {
+    printf("[TEST] Batched Layer Activation... ");
+
+    // activate() must match the single-node ops, forward and backward
+    Activation acts[] = {ACT_TANH, ACT_RELU, ACT_LEAKY_RELU, ACT_SIGMOID, ACT_GELU};
+    Value* (*ops[])(Value *self) = {v_tanh, relu, leaky_relu, v_sigmoid, v_gelu};
+    float points[] = {-1.5, -0.2, 0.4, 2.0};
+
+    for (int a=0; a<5; a++) {
+        float ref_data[4], ref_grad[4];
+        for (int i=0; i<4; i++) {
+            Value *ref_in = new_val(points[i], NULL, NULL);
+            Value *ref_out = ops[a](ref_in);
+            ref_data[i] = ref_out->data;
+            backward(mul_scalar(ref_out, i + 1), false);
+            ref_grad[i] = ref_in->grad;
+        }
+
+        Value *x[4], *batch[4];
+        for (int i=0; i<4; i++) batch[i] = x[i] = new_val(points[i], NULL, NULL);
+        activate(batch, 4, acts[a]);
+
+        Value *loss = new_val(0, NULL, NULL);
+        for (int i=0; i<4; i++) {
+            assert(batch[i]->prev[0] == x[i]);
+            assert(is_close(batch[i]->data, ref_data[i]));
+            loss = add(loss, mul_scalar(batch[i], i + 1));
+        }
+        backward(loss, true); // x still lives on the tape
+        for (int i=0; i<4; i++) {
+            assert(is_close(x[i]->grad, ref_grad[i]));
+        }
+        free_vals();
+    }
+
+    // ACT_NONE records nothing
+    Value *x[1] = {new_val(3.0, NULL, NULL)};
+    Value *before = x[0];
+    activate(x, 1, ACT_NONE);
+    assert(x[0] == before);
+    free_vals();
+
+    printf("PASSED\n");
+}
+
+// runs one layer through `fwd` and collects the input and weight gradients of sum_j (j+1)*out[j]
+void layer_grads(Layer *l, Value** (*fwd)(Layer *l, Value **x), bool dfs, float *out_data, float *grads) {
+    float points[] = {0.3, -1.2, 0.8};
+    Value *x[3];
+    for (int i=0; i<3; i++) x[i] = new_val(points[i], NULL, NULL);
+
+    Value **out = fwd(l, x);
+    Value *loss = new_val(0, NULL, NULL);
+    for (int j=0; j<l->nout; j++) {
+        out_data[j] = out[j]->data;
+        loss = add(loss, mul_scalar(out[j], j + 1));
+    }
+    zero_grad();
+    if (dfs) backward_dfs(loss, true);
+    else backward(loss, true);
+
+    int k = 0;
+    for (int i=0; i<3; i++) grads[k++] = x[i]->grad;
+    for (int i=0; i<l->nout*l->nin; i++) grads[k++] = l->weights[i]->grad;
+    for (int j=0; j<l->nout; j++) grads[k++] = l->biases[j]->grad;
+    free_vals();
+}
+
+void test_dense() {
+    printf("[TEST] Fused Dense Layer... ");
+
+    Activation acts[] = {ACT_NONE, ACT_TANH, ACT_RELU, ACT_LEAKY_RELU, ACT_SIGMOID, ACT_GELU};
+    for (int a=0; a<6; a++) {
+        Layer *l = new_layer(3, 4, acts[a]);
+        float ref_out[4], ref_grads[3 + 12 + 4];
+        float out[4], grads[3 + 12 + 4];
+
+        layer_grads(l, layer_forward_unfused, false, ref_out, ref_grads);
+        layer_grads(l, layer_forward, false, out, grads);
+        for (int j=0; j<4; j++) assert(is_close(out[j], ref_out[j]));
+        for (int k=0; k<19; k++) assert(is_close(grads[k], ref_grads[k]));
+
+        layer_grads(l, layer_forward, true, out, grads); // DFS must find the kernel too
+        for (int k=0; k<19; k++) assert(is_close(grads[k], ref_grads[k]));
+
+        // the whole layer is nout tape nodes
+        Value *x[3] = {new_val(1, NULL, NULL), new_val(2, NULL, NULL), new_val(3, NULL, NULL)};
+        Value **o = layer_forward(l, x);
+        assert(o[0]->tape_idx == x[2]->tape_idx + 1);
+        assert(o[3]->tape_idx == o[0]->tape_idx + 3);
+        free_vals();
+
+        free_layer(l);
+    }
+    free_params();
+
+    printf("PASSED\n");
+}
+
+void test_dataset() {
+    printf("[TEST] Binary Dataset & Input Binding... ");
+
+    const char *path = "test_dataset.bin";
+    float rows[4][3] = {{0, 0, 0}, {0, 1, 1}, {1, 0, 1}, {1, 1, 0}}; // XOR: 2 inputs, 1 target
+    assert(dataset_write(path, &rows[0][0], 4, 2, 1) == 0);
+
+    Dataset *ds = dataset_open(path);
+    assert(ds != NULL);
+    assert(ds->nrows == 4 && ds->ninputs == 2 && ds->ntargets == 1);
+    assert(dataset_row(ds, 2)[0] == 1 && dataset_row(ds, 2)[1] == 0);
+    assert(dataset_targets(ds, 3)[0] == 0);
+
+    // feeding a mapped row must match building the inputs by hand
+    int layerdims[] = {4, 1};
+    MLP *mlp = new_mlp(2, 2, layerdims, NULL);
+    Value *w0 = mlp->layers[0]->weights[1];
+
+    Value *x[2] = {new_val(0, NULL, NULL), new_val(1, NULL, NULL)};
+    Value *ref = forward(mlp, x)[0];
+    float ref_data = ref->data;
+    zero_grad();
+    backward(ref, false);
+    float ref_grad = w0->grad;
+
+    Value *out = forward_input(mlp, dataset_row(ds, 1))[0];
+    assert(out->tape_idx == 4); // no input nodes: hidden layer is 0..3, output is 4
+    assert(is_close(out->data, ref_data));
+    zero_grad();
+    backward(out, false);
+    assert(is_close(w0->grad, ref_grad));
+
+    free_mlp(mlp);
+    dataset_close(ds);
+
+    // a file cut short is rejected instead of read past its end
+    FILE *f = fopen(path, "r+b");
+    assert(f != NULL);
+    assert(ftruncate(fileno(f), sizeof(DatasetHeader) + 5 * sizeof(float)) == 0);
+    fclose(f);
+    assert(dataset_open(path) == NULL);
+
+    // headers whose row size arithmetic would wrap to the size of the file (no rows)
+    DatasetHeader bad[2];
+    for (int k=0; k<2; k++) {
+        memcpy(bad[k].magic, DATASET_MAGIC, 4);
+        bad[k].version = DATASET_VERSION;
+        bad[k].dtype = DATASET_F32;
+        bad[k].reserved = 0;
+    }
+    bad[0].ninputs = 0xFFFFFFFF, bad[0].ntargets = 1, bad[0].nrows = 5; // 32-bit stride wraps to 0
+    bad[1].ninputs = 3, bad[1].ntargets = 1, bad[1].nrows = 1ULL << 62; // 64-bit size wraps to 0
+    for (int k=0; k<2; k++) {
+        f = fopen(path, "wb");
+        fwrite(&bad[k], sizeof(DatasetHeader), 1, f);
+        fclose(f);
+        assert(dataset_open(path) == NULL);
+    }
+    remove(path);
+
+    printf("PASSED\n");
+}
+
+void test_csv() {
+    printf("[TEST] CSV Conversion... ");
+
+    const char *csv = "test_dataset.csv", *bin = "test_dataset.bin";
+    FILE *f = fopen(csv, "w");
+    assert(f != NULL);
+    // header, CRLF line endings, a blank line and no newline at the very end
+    fputs("x0,x1,y\r\n0.5,-1.25e2,1\r\n\n 3 , .125 ,-0\n1234567.5,2E-3,7", f);
+    fclose(f);
+
+    assert(dataset_from_csv(csv, bin, 1) == 3);
+    Dataset *ds = dataset_open(bin);
+    assert(ds != NULL);
+    assert(ds->nrows == 3 && ds->ninputs == 2 && ds->ntargets == 1);
+    float expected[3][3] = {{0.5, -125, 1}, {3, 0.125, 0}, {1234567.5, 0.002, 7}};
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) assert(dataset_row(ds, i)[j] == expected[i][j]);
+    }
+    dataset_close(ds);
+
+    // ragged rows are reported, not silently padded
+    f = fopen(csv, "w");
+    fputs("1,2,3\n4,5\n", f);
+    fclose(f);
+    assert(dataset_from_csv(csv, bin, 1) == -1);
+
+    remove(csv);
+    remove(bin);
+    printf("PASSED\n");
+}
+
+void test_prefetch() {
+    printf("[TEST] Prefetched Minibatches... ");
+
+    const char *path = "test_dataset.bin";
+    float rows[10][2];
+    for (int i=0; i<10; i++) {
+        rows[i][0] = i;
+        rows[i][1] = 2 * i; // target, so we can tell rows weren't torn
+    }
+    assert(dataset_write(path, &rows[0][0], 10, 1, 1) == 0);
+    Dataset *ds = dataset_open(path);
+
+    // 5 batches of 4 = 2 full epochs, so every row shows up exactly twice
+    int seen[10] = {0};
+    Prefetcher *p = prefetch_start(ds, 4, 42);
+    for (int b=0; b<5; b++) {
+        const Batch *batch = prefetch_next(p);
+        assert(batch->size == 4);
+        for (int k=0; k<4; k++) {
+            float *row = batch->rows + k * ds->stride;
+            assert(row[1] == 2 * row[0]);
+            seen[(int)row[0]]++;
+        }
+        assert(p->last_wait_ms >= 0);
+    }
+    prefetch_stop(p);
+    for (int i=0; i<10; i++) assert(seen[i] == 2);
+
+    // a slow trainer leaves the producer with both slots full: it sleeps instead of spinning,
+    // and a producer asleep at stop still gets joined
+    p = prefetch_start(ds, 4, 42);
+    prefetch_next(p);
+    struct timespec cpu0, cpu1;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+    usleep(200 * 1000);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+    double cpu_ms = (cpu1.tv_sec - cpu0.tv_sec) * 1e3 + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e6;
+    assert(cpu_ms < 100);
+    assert(prefetch_next(p)->size == 4);
+    prefetch_stop(p);
+    assert(prefetch_start(ds, 0, 42) == NULL);
+    dataset_close(ds);
+
+    // a header-only CSV converts to a dataset with no rows, which has no batches to give
+    const char *csv = "test_empty.csv";
+    FILE *f = fopen(csv, "w");
+    fputs("x,y\n", f);
+    fclose(f);
+    assert(dataset_from_csv(csv, path, 1) == 0);
+    ds = dataset_open(path);
+    assert(ds != NULL && ds->nrows == 0);
+    assert(prefetch_start(ds, 4, 42) == NULL);
+    dataset_close(ds);
+
+    remove(csv);
+    remove(path);
+    printf("PASSED\n");
+}
+
+void test_inputs() {
+    printf("[TEST] Input Placeholders... ");
+
+    int layerdims[] = {3, 1};
+    MLP *mlp = new_mlp(2, 2, layerdims, NULL);
+    Value **x = new_inputs(2, true);
+    Value **x_nograd = new_inputs(2, false);
+
+    float samples[2][2] = {{0.5, -1.0}, {2.0, 0.25}};
+    for (int s=0; s<2; s++) {
+        // reference: fresh tape leaves
+        Value *ref_x[2] = {new_val(samples[s][0], NULL, NULL), new_val(samples[s][1], NULL, NULL)};
+        Value *ref = forward(mlp, ref_x)[0];
+        float ref_data = ref->data;
+        zero_grad();
+        backward(ref, true);
+        float ref_grads[2] = {ref_x[0]->grad, ref_x[1]->grad};
+        float ref_wgrad = mlp->layers[0]->weights[0]->grad;
+        free_vals();
+
+        bind_inputs(x, samples[s], 2);
+        Value *out = forward(mlp, x)[0];
+        assert(out->tape_idx == 3); // nothing on the tape but the two layers
+        assert(is_close(out->data, ref_data));
         zero_grad();
-        backward(out[0], false); // Linear sweep
+        backward(out, false);
+        assert(is_close(x[0]->grad, ref_grads[0]) && is_close(x[1]->grad, ref_grads[1]));
+
+        // without input grads the weights still learn, the inputs are left alone
+        bind_inputs(x_nograd, samples[s], 2);
+        out = forward(mlp, x_nograd)[0];
+        zero_grad();
+        backward(out, false);
+        assert(is_close(mlp->layers[0]->weights[0]->grad, ref_wgrad));
+        assert(x_nograd[0]->grad == 0 && x_nograd[1]->grad == 0);
     }
-    
-    clock_t end = clock();
-    double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-    
-    printf("   -> Time for %d passes: %.4f seconds\n", runs, cpu_time_used);
 
+    // rebinding a placeholder that a recorded node still reads is an error
+    fflush(stdout); // or the child flushes our buffered output again on exit
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        bind_inputs(x, samples[0], 2);
+        forward(mlp, x);
+        bind_inputs(x, samples[1], 2);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+    free_inputs(x);
+    free_inputs(x_nograd);
     free_mlp(mlp);
+    printf("PASSED\n");
 }
 
-void compare_algorithms() {
-    printf("\n=== ALGORITHM COMPARISON: Linear Sweep vs DFS ===\n");
+void test_checkpoint() {
+    printf("[TEST] Checkpoint Save/Load... ");
 
-    // ---------------------------------------------------------
-    // TEST 1: The Disjoint Graph (Sparse)
-    // Scenario: The tape is full of garbage nodes (noise) that 
-    // contribute nothing to the final loss.
-    // Prediction: DFS should win (skips garbage).
-    // ---------------------------------------------------------
-    printf("\n[CASE 1] Disjoint Graph (High Noise)\n");
-    
-    // 1. Create Noise (10,000 nodes disconnected from loss)
-    for(int i=0; i<10000; i++) {
-        Value *a = new_val(i, NULL, NULL);
-        Value *b = new_val(i, NULL, NULL);
-        mul(a, b);
+    const char *path = "test_model.ckpt";
+    int layerdims[] = {5, 3, 2};
+    Activation activations[] = {ACT_RELU, ACT_SIGMOID, ACT_NONE};
+    MLP *mlp = new_mlp(4, 3, layerdims, activations);
+    mlp->layers[2]->biases[1]->data = 0.75; // make sure biases round-trip too
+
+    float x[4] = {0.1, -0.7, 1.5, 0.3};
+    Value **ref = forward_input(mlp, x);
+    float ref_out[2] = {ref[0]->data, ref[1]->data};
+    free_vals();
+
+    float y[2];
+    mlp_predict(mlp, x, y); // tape-free inference agrees with forward
+    assert(is_close(y[0], ref_out[0]) && is_close(y[1], ref_out[1]));
+
+    assert(mlp_save(mlp, path) == 0);
+    free_mlp(mlp);
+
+    MLP *mapped = mlp_load_mapped(path);
+    assert(mapped != NULL && mapped->nlayers == 3);
+    assert(((uintptr_t)mapped->blob) % CHECKPOINT_ALIGN == 0);
+    assert(mapped->layers[1]->activation == ACT_SIGMOID);
+    mlp_predict(mapped, x, y);
+    assert(y[0] == ref_out[0] && y[1] == ref_out[1]);
+
+    MLP *loaded = mlp_load(path);
+    assert(loaded != NULL);
+    Value **out = forward_input(loaded, x);
+    assert(out[0]->data == ref_out[0] && out[1]->data == ref_out[1]);
+    free_vals();
+
+    // re-saving a mapped model gives back the same file
+    const char *path2 = "test_model2.ckpt";
+    assert(mlp_save(mapped, path2) == 0);
+    MLP *again = mlp_load_mapped(path2);
+    assert(memcmp(again->blob, mapped->blob, mapped->map_size - ((char *)mapped->blob - (char *)mapped->map)) == 0);
+
+    free_mlp(again);
+    free_mlp(mapped);
+    free_mlp(loaded);
+
+    // crafted headers are rejected before anything is allocated from them
+    uint32_t bad[][2] = {
+        {offsetof(CheckpointHeader, nlayers), 0xFFFFFFFF},
+        {sizeof(CheckpointHeader) + offsetof(CheckpointLayer, nout), 0},
+        {sizeof(CheckpointHeader) + sizeof(CheckpointLayer) + offsetof(CheckpointLayer, activation), 99},
+        {offsetof(CheckpointHeader, inputdim), 0x80000000},
+    };
+    MLP *good = mlp_load_mapped(path2);
+    for (int k=0; k<4; k++) {
+        assert(mlp_save(good, path) == 0);
+        FILE *f = fopen(path, "r+b");
+        fseek(f, bad[k][0], SEEK_SET);
+        fwrite(&bad[k][1], sizeof(uint32_t), 1, f);
+        fclose(f);
+        assert(mlp_load(path) == NULL && mlp_load_mapped(path) == NULL);
     }
-    
-    // 2. Create Signal (500 nodes connected to loss)
+    free_mlp(good);
+
+    remove(path);
+    remove(path2);
+    printf("PASSED\n");
+}
+
+void test_async_checkpoint() {
+    printf("[TEST] Async Checkpointing... ");
+
+    const char *path = "test_model.ckpt";
+    int layerdims[] = {3, 1};
+    MLP *mlp = new_mlp(2, 2, layerdims, NULL);
+    Value *w = mlp->layers[0]->weights[0];
+
+    AsyncCheckpointer *c = checkpoint_start(mlp, path, 2);
+    checkpoint_step(c, 1); // not a checkpoint step
+    assert(!c->pending);
+
+    float snapshot = w->data;
+    checkpoint_step(c, 2);
+    w->data += 1.0; // training moves on while the snapshot is written
+    assert(checkpoint_stop(c) == 1);
+
+    MLP *saved = mlp_load_mapped(path);
+    assert(saved != NULL);
+    assert(saved->blob[0] == snapshot);
+    free_mlp(saved);
+
+    FILE *tmp = fopen("test_model.ckpt.tmp", "r"); // renamed into place, nothing left over
+    assert(tmp == NULL);
+
+    assert(checkpoint_start(mlp, path, 0) == NULL);
+    assert(checkpoint_start(mlp, path, -5) == NULL);
+
+    free_mlp(mlp);
+    remove(path);
+    printf("PASSED\n");
+}
+
+void test_profile() {
+    printf("[TEST] Per-op Profile... ");
+
+    char *json = NULL;
+    size_t len = 0;
+    profile_reset();
+    Value *a = new_val(0.5, NULL, NULL);
+    Value *b = new_val(-2.0, NULL, NULL);
+    Value *c = v_tanh(add(mul(a, b), a));
+    backward(c, false);
+
+    FILE *f = open_memstream(&json, &len);
+    profile_report_json(f);
+    fclose(f);
+#ifdef MICROGRAD_PROFILE
+    assert(strstr(json, "\"sweeps\": 1,") != NULL);
+    assert(strstr(json, "{\"op\": \"leaf\", \"created\": 2, \"backward_calls\": 2,") != NULL);
+    assert(strstr(json, "{\"op\": \"mul\", \"created\": 1, \"backward_calls\": 1,") != NULL);
+    assert(strstr(json, "{\"op\": \"tanh\", \"created\": 1, \"backward_calls\": 1,") != NULL);
+    assert(strstr(json, "\"relu\"") == NULL); // ops that never ran are left out
+#else
+    assert(strcmp(json, "{\"enabled\": false}\n") == 0);
+#endif
+    free(json);
+    printf("PASSED\n");
+}
+
+static int limit_calls = 0;
+static int limit_nodes = 0;
+
+static void on_tape_limit(MemStats *stats, void *arg) {
+    limit_calls++;
+    limit_nodes = stats->tape_nodes;
+    *(bool *)arg = true;
+}
+
+void test_memstats() {
+    printf("[TEST] Memory Accounting & Tape Soft Limit... ");
+
+    MemStats before = mg_memstats();
+    int layerdims[] = {4, 1};
+    MLP *mlp = new_mlp(3, 2, layerdims, NULL);
+    MemStats after = mg_memstats();
+    long nparams = (3*4 + 4) + (4*1 + 1);
+    assert(after.params - before.params == nparams);
+    assert(after.param_bytes - before.param_bytes == nparams * sizeof(Value));
+    // mlp + layer array, 5 per layer, 2 per neuron, one per param
+    assert(after.mallocs - before.mallocs == 2 + 2*5 + 5*2 + nparams);
+    assert(after.tape_nodes == 0);
+
+    bool full = false;
+    mg_set_tape_limit(10, on_tape_limit, &full);
+    Value *x = new_val(1.0, NULL, NULL);
+    int steps = 0;
+    while (!full) {
+        x = add_scalar(x, 1.0);
+        steps++;
+    }
+    assert(limit_calls == 1 && limit_nodes == 10 && steps == 10);
+    for (int i=0; i<20; i++) x = add_scalar(x, 1.0); // fires once per recording
+    assert(limit_calls == 1);
+    MemStats s = mg_memstats();
+    assert(s.tape_nodes == 31 && s.peak_tape_nodes >= 31);
+    assert(s.tape_bytes == tape_bytes() && s.peak_tape_bytes >= s.tape_bytes);
+
+    free_vals(); // re-arms the limit
+    assert(mg_memstats().tape_nodes == 0 && mg_memstats().peak_tape_nodes >= 31);
+    full = false;
+    for (int i=0; i<11; i++) new_val(0.0, NULL, NULL);
+    assert(limit_calls == 2 && full);
+
+    // so does rewinding back below it, but not a rewind that stays above it
+    TapeMark mark = tape_mark();
+    for (int i=0; i<5; i++) new_val(0.0, NULL, NULL);
+    tape_rewind(mark);
+    new_val(0.0, NULL, NULL);
+    assert(limit_calls == 2);
+    free_vals();
+    mark = tape_mark();
+    for (int i=0; i<11; i++) new_val(0.0, NULL, NULL);
+    assert(limit_calls == 3);
+    tape_rewind(mark);
+    full = false;
+    for (int i=0; i<11; i++) new_val(0.0, NULL, NULL);
+    assert(limit_calls == 4 && full);
+    mg_set_tape_limit(0, NULL, NULL);
+    free_vals();
+
+    free_mlp(mlp); // also frees every param, not just this model's
+    assert(mg_memstats().params == 0);
+    printf("PASSED\n");
+}
+
+static int count_substr(const char *s, const char *sub) {
+    int n = 0;
+    for (const char *p = strstr(s, sub); p != NULL; p = strstr(p + 1, sub)) n++;
+    return n;
+}
+
+static void *traced_thread(void *arg) {
+    trace_thread_name("worker");
+    TRACE_BEGIN("work");
+    TRACE_END("work");
+    return NULL;
+}
+
+void test_trace() {
+    printf("[TEST] Chrome Trace Export... ");
+
+    int layerdims[] = {3, 1};
+    MLP *mlp = new_mlp(2, 2, layerdims, NULL);
+    Value **x = new_inputs(2, false);
+
+    trace_reset();
+    Value **out = forward(mlp, x); // not tracing yet, records nothing
+    backward(out[0], false);
+
+    trace_start();
+    out = forward(mlp, x);
+    zero_grad();
+    backward(out[0], false);
+    update_params(0.01);
+    pthread_t t;
+    pthread_create(&t, NULL, traced_thread, NULL);
+    pthread_join(t, NULL);
+    trace_stop();
+
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+    assert(trace_write(f) == 0);
+    fclose(f);
+    assert(count_substr(json, "\"name\": \"forward\", \"ph\": \"B\"") == 1);
+    assert(count_substr(json, "\"name\": \"layer_forward\", \"ph\": \"B\"") == 2);
+    assert(count_substr(json, "\"name\": \"layer_forward\", \"ph\": \"E\"") == 2);
+    assert(count_substr(json, "\"name\": \"backward\", \"ph\": \"E\"") == 1);
+    assert(count_substr(json, "\"name\": \"zero_grad\"") == 2);
+    assert(count_substr(json, "\"name\": \"update_params\"") == 2);
+    assert(count_substr(json, "\"args\": {\"name\": \"worker\"}") == 1);
+    assert(count_substr(json, "\"name\": \"work\"") == 2);
+    assert(count_substr(json, "\"ph\": \"B\"") == count_substr(json, "\"ph\": \"E\""));
+    free(json);
+
+    trace_reset();
+    free_inputs(x);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
+
+void test_perfcount() {
+    printf("[TEST] Hardware Counters... ");
+
+    PerfCounters *pc = perf_open(); // works with or without a PMU
     Value *head = new_val(1.0, NULL, NULL);
-    for(int i=0; i<500; i++) {
-        head = add(head, new_val(0.5, NULL, NULL));
+    for (int i=0; i<999; i++) head = add_scalar(head, 0.5);
+    perf_backward(pc, backward, head, false);
+    assert(pc->nodes == 1000 && tape_size() == 0);
+    if (perf_available(pc, PERF_INSTRUCTIONS)) assert(pc->value[PERF_INSTRUCTIONS] > 1000);
+    for (int e=0; e<PERF_NEVENTS; e++) {
+        if (!perf_available(pc, e)) assert(pc->value[e] == 0);
     }
-    Value *loss = head;
 
-    // Benchmark Linear
-    clock_t start = clock();
-    for(int i=0; i<1000; i++) {
-        zero_grad();
-        backward(loss, true); // retain_graph=true to reuse data
+    char *report = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&report, &len);
+    perf_report(f, pc, "sweep", pc->nodes);
+    fclose(f);
+    assert(strncmp(report, "sweep", 5) == 0);
+    assert(strstr(report, (pc->navailable > 0) ? "/node" : "unavailable") != NULL);
+    free(report);
+
+    perf_reset(pc);
+    assert(pc->nodes == 0 && pc->value[PERF_CYCLES] == 0);
+    int available = pc->navailable;
+    perf_close(pc);
+    printf("PASSED (%d/%d counters available)\n", available, PERF_NEVENTS);
+}
+
+void test_checkpointed_forward() {
+    printf("[TEST] Gradient Checkpointing... ");
+
+    int nlayers = 9;
+    int layerdims[] = {6, 6, 6, 6, 6, 6, 6, 6, 2};
+    MLP *mlp = new_mlp(3, nlayers, layerdims, NULL);
+    Value **x = new_inputs(3, true);
+    float data[] = {0.3, -0.7, 0.5};
+    bind_inputs(x, data, 3);
+
+    int nparams = 0;
+    float ref_grads[400];
+    float ref_x_grads[3];
+    Value **out = forward(mlp, x);
+    float ref_out[2] = {out[0]->data, out[1]->data};
+    int plain_nodes = tape_size();
+    zero_grad();
+    backward(add(out[0], out[1]), false);
+    for (int i=0; i<nlayers; i++) {
+        Layer *l = mlp->layers[i];
+        for (int k=0; k<l->nout * l->nin; k++) ref_grads[nparams++] = l->weights[k]->grad;
+        for (int j=0; j<l->nout; j++) ref_grads[nparams++] = l->biases[j]->grad;
     }
-    double time_linear = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+    for (int i=0; i<3; i++) ref_x_grads[i] = x[i]->grad;
 
-    // Benchmark DFS
-    start = clock();
-    for(int i=0; i<1000; i++) {
+    void (*sweeps[2])(Value *root, bool retain_graph) = {backward, backward_dfs};
+    for (int s=0; s<2; s++) {
+        bind_inputs(x, data, 3);
+        mg_reset_peak();
+        out = forward_checkpointed(mlp, x, 0); // 3 segments of 3 layers
+        assert(out[0]->data == ref_out[0] && out[1]->data == ref_out[1]);
+        assert(tape_size() == 6 + 6 + 2); // just the segment boundaries
+        assert(tape_size() < plain_nodes);
         zero_grad();
-        backward_dfs(loss, true);
+        sweeps[s](add(out[0], out[1]), false);
+
+        int p = 0;
+        for (int i=0; i<nlayers; i++) {
+            Layer *l = mlp->layers[i];
+            for (int k=0; k<l->nout * l->nin; k++) assert(l->weights[k]->grad == ref_grads[p++]);
+            for (int j=0; j<l->nout; j++) assert(l->biases[j]->grad == ref_grads[p++]);
+        }
+        for (int i=0; i<3; i++) assert(x[i]->grad == ref_x_grads[i]);
+        // the boundaries, the loss, and one segment being recomputed at a time
+        assert(mg_memstats().peak_tape_nodes == 15 + 6 + 6 + 6);
+    }
+
+    free_inputs(x);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
+
+void test_tape_mark() {
+    printf("[TEST] Tape Mark/Rewind... ");
+
+    int layerdims[] = {4, 1};
+    MLP *mlp = new_mlp(2, 2, layerdims, NULL);
+    Value **x = new_inputs(2, false);
+    float data[] = {0.5, -1.0};
+    bind_inputs(x, data, 2);
+
+    // reference: loss = out^2, no scratch work in between
+    Value **out = forward(mlp, x);
+    zero_grad();
+    backward(v_pow(out[0], 2), false);
+    float ref = mlp->layers[0]->weights[0]->grad;
+
+    out = forward(mlp, x);
+    Value *y = out[0];
+    int live = tape_size();
+    size_t live_bytes = tape_bytes();
+
+    // scratch work mid-step: a logging expression and a whole second forward
+    TapeMark mark = tape_mark();
+    Value *metric = v_sqrt(v_pow(y, 2));
+    assert(is_close(metric->data, fabsf(y->data)));
+    forward(mlp, x);
+    assert(tape_size() > live);
+    tape_rewind(mark);
+    assert(tape_size() == live && tape_bytes() == live_bytes);
+
+    // nested marks
+    TapeMark outer = tape_mark();
+    add_scalar(y, 1.0);
+    TapeMark inner = tape_mark();
+    mul_scalar(y, 2.0);
+    tape_rewind(inner);
+    assert(tape_size() == live + 1);
+    tape_rewind(outer);
+    assert(tape_size() == live);
+
+    // the training graph carries on as if nothing happened
+    zero_grad();
+    backward(v_pow(y, 2), false);
+    assert(mlp->layers[0]->weights[0]->grad == ref);
+
+    free_inputs(x);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
+
+void test_const_folding() {
+    printf("[TEST] Constant Folding & Identities... ");
+
+    Value *x = new_val(2.0, NULL, NULL);
+    Value *zero = new_const(0.0);
+    Value *one = new_const(1.0);
+    int n = tape_size();
+
+    // identities return the other operand, nothing is recorded
+    assert(add(zero, x) == x && add(x, zero) == x && sub(x, zero) == x);
+    assert(mul(one, x) == x && mul(x, one) == x);
+    assert(v_pow(x, 1) == x && add_scalar(x, 0) == x && mul_scalar(x, 1) == x);
+    assert(tape_size() == n);
+
+    // x*0 and x^0 are constants
+    Value *z = mul(x, zero);
+    assert(z->data == 0 && z->prev[0] == NULL);
+    assert(v_pow(x, 0)->data == 1);
+
+    // constant-only expressions fold into one constant
+    n = tape_size();
+    Value *c = v_exp(add(new_const(2.0), mul(new_const(3.0), one)));
+    assert(is_close(c->data, expf(5.0)) && c->prev[0] == NULL);
+    assert(tape_size() == n + 5); // the 3 constants made here, then one per folded op
+    n = tape_size();
+
+    // a constant operand moves into the immediate of a scalar op: one node, not two
+    Value *y = add(mul(new_const(3.0), x), sub(x, one)); // 3x + (x - 1)
+    assert(tape_size() == n + 4);
+    assert(y->data == 7.0);
+    backward(y, true);
+    assert(x->grad == 4.0 && zero->grad == 0 && one->grad == 0);
+    zero_grad_all();
+    backward_dfs(y, false);
+    assert(x->grad == 4.0);
+
+    // the unfused neuron: the sum starts at a constant 0 that the first add folds away
+    Neuron *neuron = new_neuron(3);
+    Value **in = new_inputs(3, false);
+    n = tape_size();
+    neuron_forward(neuron, in);
+    assert(tape_size() == n + 2*3 + 1);
+    free_vals();
+    free_inputs(in);
+    free(neuron->weights);
+    free(neuron);
+    free_params();
+    printf("PASSED\n");
+}
+
+void test_cse() {
+    printf("[TEST] Common-Subexpression Elimination... ");
+
+    Value *a = new_val(1.5, NULL, NULL);
+    Value *b = new_val(-0.5, NULL, NULL);
+    int n = tape_size();
+    assert(add(a, b) != add(a, b)); // off by default
+    assert(tape_size() == n + 2);
+
+    cse_enable(true);
+    cse_reset_stats();
+    Value *diff = sub(a, b);
+    Value *sq = v_pow(diff, 2);
+    n = tape_size();
+    assert(v_pow(sub(a, b), 2) == sq); // the same expression again records nothing
+    assert(mul(a, b) == mul(b, a)); // commutative ops match either way round
+    assert(sub(b, a) != diff); // ...the others don't
+    assert(v_pow(diff, 3) != sq && mul_scalar(diff, 2) != mul_scalar(diff, 3)); // imm is part of the key
+    assert(tape_size() == n + 1 + 2 + 2);
+
+    // the shared node gets both consumers' gradients
+    Value *loss = add(sq, v_pow(sub(a, b), 2)); // 2 (a-b)^2
+    backward(loss, false);
+    assert(is_close(a->grad, 8.0) && is_close(b->grad, -8.0));
+
+    // nodes from before free_vals are never handed out again
+    Value *c = new_val(1.5, NULL, NULL);
+    Value *d = new_val(-0.5, NULL, NULL);
+    sub(c, d);
+    free_vals();
+    c = new_val(2.0, NULL, NULL); // same slots, so same pointers and the same key
+    d = new_val(-0.5, NULL, NULL);
+    long hits = cse_stats().hits;
+    assert(sub(c, d)->data == 2.5 && cse_stats().hits == hits);
+
+    // nor nodes whose inputs have changed value since
+    Value **x = new_inputs(1, false);
+    bind_inputs(x, (float[]){1.0}, 1);
+    Value *y = v_tanh(mul(c, x[0]));
+    bind_inputs(x, (float[]){2.0}, 1);
+    Value *y2 = v_tanh(mul(c, x[0]));
+#ifdef MICROGRAD_FAST_TANH
+    float tanh4 = fast_tanhf(4.0); // what v_tanh computes in this build
+#else
+    float tanh4 = tanhf(4.0);
+#endif
+    assert(y2 != y && y2->data == tanh4 && cse_stats().hits == hits);
+
+    CseStats stats = cse_stats();
+    assert(stats.hits == 5 && stats.lookups > stats.hits);
+    assert(is_close(stats.hit_rate, (double)stats.hits / stats.lookups));
+    cse_enable(false);
+    free_inputs(x);
+    free_vals();
+    printf("PASSED (hit rate %.0f%%)\n", 100 * stats.hit_rate);
+}
+
+void test_tape_compact() {
+    printf("[TEST] Tape Compaction... ");
+
+    int layerdims[] = {5, 3, 1};
+    MLP *mlp = new_mlp(2, 3, layerdims, NULL);
+    Value **x = new_inputs(2, true);
+    bind_inputs(x, (float[]){0.4, -0.9}, 2);
+
+    // a training graph with logging garbage recorded in between
+    mg_reset_peak(); // the tape is empty, so only this graph counts
+    for (int i=0; i<50; i++) mul(new_val(i, NULL, NULL), new_val(i, NULL, NULL));
+    Value **out = forward(mlp, x);
+    Value *pred = out[0];
+    for (int i=0; i<50; i++) v_tanh(add_scalar(pred, i));
+    Value *c = new_val(0.25, NULL, NULL);
+    Value *loss = mul(v_pow(add_scalar(pred, -1.0), 2), c);
+    for (int i=0; i<50; i++) v_exp(loss);
+
+    float data = loss->data;
+    zero_grad();
+    backward(loss, true);
+    float ref_w = mlp->layers[0]->weights[3]->grad;
+    float ref_x = x[1]->grad;
+    float ref_c = c->grad;
+
+    int before = tape_size();
+    loss = tape_compact(loss);
+    assert(mg_memstats().peak_tape_nodes == before); // the peak survives the compaction
+    // the 3 dense groups (the inputs live off the tape), c, and the 3 loss ops
+    assert(tape_size() == 5 + 3 + 1 + 1 + 3);
+    assert(tape_size() < before && loss->tape_idx == tape_size() - 1 && loss->data == data);
+
+    // same gradients, now from a sweep over live nodes only (twice, the graph is still there)
+    for (int pass=0; pass<2; pass++) {
+        zero_grad_all();
+        x[1]->grad = 0;
+        backward(loss, true);
+        assert(mlp->layers[0]->weights[3]->grad == ref_w);
+        assert(x[1]->grad == ref_x);
+        assert(loss->prev[1]->grad == ref_c); // c moved too
     }
-    double time_dfs = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+    zero_grad_all();
+    x[1]->grad = 0;
+    backward_dfs(loss, false);
+    assert(mlp->layers[0]->weights[3]->grad == ref_w && x[1]->grad == ref_x);
 
-    printf("   Linear Time: %.4f s (Processed garbage)\n", time_linear);
-    printf("   DFS Time:    %.4f s (Skipped garbage)\n", time_dfs);
-    if (time_dfs < time_linear)
-        printf("   >> WINNER: DFS (%.2fx faster)\n", time_linear/time_dfs);
-    else
-        printf("   >> WINNER: Linear\n");
+    // identity folding can hand back a root that isn't on the tape: nothing there is live
+    Value *a = new_param(2.0);
+    for (int i=0; i<10; i++) add(a, a);
+    Value *root = mul_scalar(a, 1);
+    assert(root == a && tape_size() == 10);
+    assert(tape_compact(root) == a && tape_size() == 0);
+    zero_grad();
+    backward(a, false);
+    assert(a->grad == 1);
 
-    free_vals(); // RESET TAPE FOR ROUND 2
+    free_inputs(x);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
 
-    // ---------------------------------------------------------
-    // TEST 2: The Connected Graph (Dense)
-    // Scenario: Every node on the tape is part of the computation.
-    // Prediction: Linear Sweep should win (CPU Cache Locality).
-    // ---------------------------------------------------------
-    printf("\n[CASE 2] Fully Connected Graph (No Noise)\n");
+// a batch through wide fused layers (split by rows) plus a wide scalar tree (split by
+// nodes), so both kinds of parallel level run. each sample reads its own input set, bound
+// once per graph; the tree reads sample 0's
+static Value *parallel_graph(MLP *mlp, Value **xs[4], Value **p, int np) {
+    Value *loss = new_const(0);
+    for (int s=0; s<4; s++) {
+        bind_inputs(xs[s], (float[]){0.1f * s, -0.3f, 0.7f - 0.2f * s}, 3);
+        Value **out = forward(mlp, xs[s]);
+        loss = add(loss, v_pow(add_scalar(out[0], -0.5f), 2));
+    }
+    Value *terms[4096];
+    for (int i=0; i<np; i++) terms[i] = v_tanh(mul(p[i], xs[0][i % 3]));
+    for (int n=np; n>1; n/=2) {
+        for (int i=0; i<n/2; i++) terms[i] = add(terms[2*i], terms[2*i+1]);
+    }
+    return add(loss, mul_scalar(terms[0], 0.001f));
+}
 
-    // 1. Create a massive chain (5000 nodes, all active)
-    head = new_val(1.0, NULL, NULL);
-    for(int i=0; i<5000; i++) {
-        head = add(head, new_val(0.5, NULL, NULL));
+static void zero_input_grads(Value **xs[], int n) {
+    for (int s=0; s<n; s++) {
+        for (int i=0; i<3; i++) xs[s][i]->grad = 0;
     }
-    loss = head;
+}
 
-    // Benchmark Linear
-    start = clock();
-    for(int i=0; i<1000; i++) {
+void test_parallel_backward() {
+    printf("[TEST] Wavefront-Parallel Backward... ");
+
+    int layerdims[] = {96, 96, 1};
+    MLP *mlp = new_mlp(3, 3, layerdims, NULL);
+    Value **xs[4];
+    for (int s=0; s<4; s++) xs[s] = new_inputs(3, true);
+    int np = 4096;
+    Value *p[4096];
+    for (int i=0; i<np; i++) p[i] = new_param(random_uniform(-1, 1));
+
+    static float ref_w[96*96];
+    float ref_p[3], ref_x[4];
+    zero_grad();
+    zero_input_grads(xs, 4);
+    Value *loss = parallel_graph(mlp, xs, p, np);
+    backward(loss, false);
+    for (int i=0; i<96*96; i++) ref_w[i] = mlp->layers[1]->weights[i]->grad;
+    for (int i=0; i<3; i++) ref_p[i] = p[i * 1000]->grad;
+    for (int s=0; s<4; s++) ref_x[s] = xs[s][0]->grad;
+    // p[1000] only reaches the loss through 0.001 * tanh(p * x) with x = xs[0][1] = -0.3
+    float t = tanhf(p[1000]->data * -0.3f);
+    assert(fabsf(ref_p[1] - 0.001f * (1 - t * t) * -0.3f) < 1e-7f);
+
+    for (int threads=1; threads<=4; threads*=2) {
+        set_backward_threads(threads);
+        assert(backward_threads() == threads);
         zero_grad();
-        backward(loss, true);
+        zero_input_grads(xs, 4);
+        loss = parallel_graph(mlp, xs, p, np);
+        backward_parallel(loss, false);
+        assert(tape_size() == 0);
+        for (int i=0; i<96*96; i++) assert(fabsf(mlp->layers[1]->weights[i]->grad - ref_w[i]) < 1e-5f);
+        for (int i=0; i<3; i++) assert(fabsf(p[i * 1000]->grad - ref_p[i]) < 1e-6f);
+        for (int s=0; s<4; s++) assert(fabsf(xs[s][0]->grad - ref_x[s]) < 1e-4f);
     }
-    time_linear = ((double)(clock() - start)) / CLOCKS_PER_SEC;
 
-    // Benchmark DFS
-    start = clock();
-    for(int i=0; i<1000; i++) {
+#ifdef MICROGRAD_PROFILE
+    // the workers' per-op counts are merged in: every node once, and time for the ops
+    // that only ran on the pool
+    set_backward_threads(4);
+    loss = parallel_graph(mlp, xs, p, np);
+    profile_reset();
+    backward_parallel(loss, false);
+    char *json = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&json, &len);
+    profile_report_json(f);
+    fclose(f);
+    assert(strstr(json, "\"sweeps\": 1,") != NULL);
+    assert(strstr(json, "{\"op\": \"dense\", \"created\": 0, \"backward_calls\": 12,") != NULL); // 3 layers x 4 samples
+    char *tanh_line = strstr(json, "{\"op\": \"tanh\", \"created\": 0, \"backward_calls\": 4096,");
+    assert(tanh_line != NULL && atoll(strstr(tanh_line, "\"backward_ns\": ") + 15) > 0);
+    free(json);
+#endif
+
+    // a checkpointed graph can't be split into levels and falls back to the serial sweep
+    Value **x = xs[0];
+    bind_inputs(x, (float[]){0.2, 0.4, -0.1}, 3);
+    zero_grad();
+    backward(forward(mlp, x)[0], false);
+    float ref = mlp->layers[0]->weights[5]->grad;
+    zero_grad();
+    backward_parallel(forward_checkpointed(mlp, x, 1)[0], false);
+    assert(fabsf(mlp->layers[0]->weights[5]->grad - ref) < 1e-6f);
+
+    // so does a root that identity folding left off the tape
+    Value *a = new_param(3.0);
+    zero_grad();
+    backward_parallel(mul_scalar(a, 1), false);
+    assert(a->grad == 1);
+    set_backward_threads(1);
+
+    for (int s=0; s<4; s++) free_inputs(xs[s]);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
+
+// gives sample s of the per-sample fixture its inputs
+static void bind_sample(Value **x, int s) {
+    bind_inputs(x, (float[]){0.3f * s - 1, 0.5f, -0.2f * s}, 3);
+}
+
+// the demo's loss: a running sum over per-sample losses, each sample marked where it starts.
+// sample s reads xs[s], which the caller has bound
+static Value *per_sample_loss(MLP *mlp, Value **xs[], TapeMark *starts, Value **losses, int n) {
+    Value *total = new_val(0, NULL, NULL);
+    for (int s=0; s<n; s++) {
+        starts[s] = tape_mark();
+        Value **out = forward(mlp, xs[s]);
+        losses[s] = v_pow(add_scalar(out[0], -0.25f * s), 2);
+        total = add(total, losses[s]);
+    }
+    return total;
+}
+
+void test_per_sample_backward() {
+    printf("[TEST] Per-Sample Parallel Backward... ");
+
+    int layerdims[] = {8, 8, 1};
+    MLP *mlp = new_mlp(3, 3, layerdims, NULL);
+    Value **xs[6];
+    for (int s=0; s<6; s++) xs[s] = new_inputs(3, true);
+
+    TapeMark starts[6];
+    Value *losses[6];
+    zero_grad();
+    zero_input_grads(xs, 6);
+    for (int s=0; s<6; s++) bind_sample(xs[s], s);
+    backward(per_sample_loss(mlp, xs, starts, losses, 6), false);
+    float ref_w = mlp->layers[0]->weights[7]->grad;
+    float ref_b = mlp->layers[2]->biases[0]->grad;
+    float ref_x[6];
+    for (int s=0; s<6; s++) ref_x[s] = xs[s][1]->grad;
+
+    for (int threads=1; threads<=4; threads*=2) {
+        set_backward_threads(threads);
         zero_grad();
-        backward_dfs(loss, true);
+        zero_input_grads(xs, 6);
+        for (int s=0; s<6; s++) bind_sample(xs[s], s);
+        backward_samples(per_sample_loss(mlp, xs, starts, losses, 6), starts, losses, 6, false);
+        assert(tape_size() == 0);
+        assert(fabsf(mlp->layers[0]->weights[7]->grad - ref_w) < 1e-5f);
+        assert(fabsf(mlp->layers[2]->biases[0]->grad - ref_b) < 1e-5f);
+        for (int s=0; s<6; s++) assert(fabsf(xs[s][1]->grad - ref_x[s]) < 1e-5f);
     }
-    time_dfs = ((double)(clock() - start)) / CLOCKS_PER_SEC;
 
-    printf("   Linear Time: %.4f s (Sequential RAM access)\n", time_linear);
-    printf("   DFS Time:    %.4f s (Random pointer jumping)\n", time_dfs);
-    
-    if (time_linear < time_dfs)
-        printf("   >> WINNER: Linear (%.2fx faster)\n", time_dfs/time_linear);
-    else
-        printf("   >> WINNER: DFS\n");
-        
-    free_vals(); // Cleanup
-    printf("\n=============================================\n");
+    // one placeholder set bound once and read by every sample: its grads take the atomic path
+    Value **shared[6];
+    for (int s=0; s<6; s++) shared[s] = xs[0];
+    bind_sample(xs[0], 2);
+    zero_grad();
+    xs[0][1]->grad = 0;
+    backward(per_sample_loss(mlp, shared, starts, losses, 6), false);
+    float ref_shared = xs[0][1]->grad;
+    set_backward_threads(4);
+    bind_sample(xs[0], 2);
+    zero_grad();
+    xs[0][1]->grad = 0;
+    backward_samples(per_sample_loss(mlp, shared, starts, losses, 6), starts, losses, 6, false);
+    assert(fabsf(xs[0][1]->grad - ref_shared) < 1e-5f);
+
+    // a sample that reads another sample's node isn't independent: the serial sweep runs
+    zero_grad();
+    Value *a = new_param(2.0);
+    starts[0] = tape_mark();
+    losses[0] = mul(a, a);
+    starts[1] = tape_mark();
+    losses[1] = mul(losses[0], a);
+    backward_samples(add(losses[0], losses[1]), starts, losses, 2, false);
+    assert(a->grad == 2 * 2.0f + 3 * 4.0f); // d/da (a^2 + a^3)
+
+    // neither is a sample whose loss folded down to a param
+    zero_grad();
+    starts[0] = tape_mark();
+    losses[0] = mul(a, a);
+    starts[1] = tape_mark();
+    losses[1] = mul_scalar(a, 1);
+    assert(losses[1] == a);
+    backward_samples(add(losses[0], losses[1]), starts, losses, 2, false);
+    assert(a->grad == 2 * 2.0f + 1); // d/da (a^2 + a)
+    set_backward_threads(1);
+
+    for (int s=0; s<6; s++) free_inputs(xs[s]);
+    free_mlp(mlp);
+    printf("PASSED\n");
+}
+
+void test_atomic_param_grads() {
+    printf("[TEST] Atomic Param Gradients... ");
+
+    int layerdims[] = {96, 96, 1};
+    MLP *mlp = new_mlp(3, 3, layerdims, NULL);
+    Value **xs[6];
+    for (int s=0; s<6; s++) xs[s] = new_inputs(3, true);
+    Value *p[4096];
+    for (int i=0; i<4096; i++) p[i] = new_param(random_uniform(-1, 1));
+    TapeMark starts[6];
+    Value *losses[6];
+
+    // reference grads from the serial sweeps
+    static float ref_wave[96*96], ref_sample[96*96];
+    zero_grad();
+    backward(parallel_graph(mlp, xs, p, 4096), false);
+    for (int i=0; i<96*96; i++) ref_wave[i] = mlp->layers[1]->weights[i]->grad;
+    float ref_p = p[17]->grad;
+    zero_grad();
+    for (int s=0; s<6; s++) bind_sample(xs[s], s);
+    backward(per_sample_loss(mlp, xs, starts, losses, 6), false);
+    for (int i=0; i<96*96; i++) ref_sample[i] = mlp->layers[1]->weights[i]->grad;
+
+    // both sweeps write the shared params from several threads at once
+    set_param_grad_mode(PARAM_GRAD_ATOMIC);
+    set_backward_threads(4);
+    zero_grad();
+    backward_parallel(parallel_graph(mlp, xs, p, 4096), false);
+    for (int i=0; i<96*96; i++) assert(fabsf(mlp->layers[1]->weights[i]->grad - ref_wave[i]) < 1e-5f);
+    assert(fabsf(p[17]->grad - ref_p) < 1e-6f);
+
+    zero_grad();
+    for (int s=0; s<6; s++) bind_sample(xs[s], s);
+    backward_samples(per_sample_loss(mlp, xs, starts, losses, 6), starts, losses, 6, false);
+    for (int i=0; i<96*96; i++) assert(fabsf(mlp->layers[1]->weights[i]->grad - ref_sample[i]) < 1e-5f);
+    set_backward_threads(1);
+    set_param_grad_mode(PARAM_GRAD_BUFFERED);
+
+    for (int s=0; s<6; s++) free_inputs(xs[s]);
+    free_mlp(mlp);
+    printf("PASSED\n");
 }
 
 int main() {
@@ -191,12 +1268,29 @@ int main() {
     
     test_basic_math();
     test_activation();
-    
-    printf("\n");
-    benchmark_model(2, 4, 1000, "Small Model (XOR Size)");
-    benchmark_model(64, 128, 1000, "Large Model");
-    
-    compare_algorithms();
+    test_scalar_ops();
+    test_more_activations();
+    test_fast_tanh();
+    test_activate();
+    test_dense();
+    test_dataset();
+    test_csv();
+    test_prefetch();
+    test_inputs();
+    test_checkpoint();
+    test_async_checkpoint();
+    test_profile();
+    test_memstats();
+    test_trace();
+    test_perfcount();
+    test_checkpointed_forward();
+    test_tape_mark();
+    test_const_folding();
+    test_cse();
+    test_tape_compact();
+    test_parallel_backward();
+    test_per_sample_backward();
+    test_atomic_param_grads();
     
     printf("\nAll tests completed successfully.\n");
     return 0;
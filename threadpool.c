@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "threadpool.h"
+
+typedef struct Worker {
+    ThreadPool *pool;
+    int tid;
+} Worker;
+
+static void *worker_thread(void *arg) {
+    Worker w = *(Worker *)arg;
+    free(arg);
+    ThreadPool *p = w.pool;
+    long seen = 0;
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->generation == seen && !p->stop) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        if (p->stop) break;
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        p->fn(p->arg, w.tid, p->nthreads);
+        atomic_fetch_sub_explicit(&p->running, 1, memory_order_release);
+
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// nthreads counts the caller, so pool_start(1) starts no threads and just runs fn inline
+ThreadPool *pool_start(int nthreads) {
+    ThreadPool *p = malloc(sizeof(ThreadPool));
+    p->nthreads = (nthreads < 1) ? 1 : nthreads;
+    p->threads = malloc(p->nthreads * sizeof(pthread_t));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    p->fn = NULL;
+    p->arg = NULL;
+    p->generation = 0;
+    atomic_init(&p->running, 0);
+    p->stop = false;
+    for (int t=1; t<p->nthreads; t++) {
+        Worker *w = malloc(sizeof(Worker));
+        w->pool = p;
+        w->tid = t;
+        if (pthread_create(&p->threads[t], NULL, worker_thread, w) != 0) {
+            fprintf(stderr, "Error: could not start worker thread\n");
+            exit(1);
+        }
+    }
+    return p;
+}
+
+// runs fn(arg, tid, nthreads) on every worker (tid 0 being the caller) and returns once
+// they have all finished
+void pool_run(ThreadPool *p, void (*fn)(void *arg, int tid, int nthreads), void *arg) {
+    if (p->nthreads == 1) {
+        fn(arg, 0, 1);
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    atomic_store_explicit(&p->running, p->nthreads - 1, memory_order_relaxed);
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    fn(arg, 0, p->nthreads);
+    while (atomic_load_explicit(&p->running, memory_order_acquire) > 0) {
+        sched_yield(); // the workers are about as far along as we are, don't sleep
+    }
+}
+
+void pool_stop(ThreadPool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->stop = true;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for (int t=1; t<p->nthreads; t++) {
+        pthread_join(p->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    free(p->threads);
+    free(p);
+}
@@ -0,0 +1,27 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// a fixed set of workers that all run the same function, fork/join style. pool_run is
+// called from one thread at a time and the caller takes part as worker 0, so a pool of
+// n has n-1 threads of its own
+typedef struct ThreadPool {
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    void (*fn)(void *arg, int tid, int nthreads);
+    void *arg;
+    long generation; // bumped by every pool_run, under lock
+    atomic_int running; // workers still busy with the current generation
+    bool stop;
+} ThreadPool;
+
+ThreadPool *pool_start(int nthreads);
+void pool_run(ThreadPool *p, void (*fn)(void *arg, int tid, int nthreads), void *arg);
+void pool_stop(ThreadPool *p);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <time.h>
+#include "trace.h"
+
+atomic_bool trace_on = false;
+
+// every ring ever created, newest first. rings are pushed lock-free and never freed,
+// so a thread's events can still be exported after it has exited
+static _Atomic(TraceRing *) rings = NULL;
+static atomic_int next_tid = 1;
+static _Thread_local TraceRing *my_ring = NULL;
+static _Thread_local const char *my_name = NULL;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static TraceRing *new_ring() {
+    TraceRing *r = malloc(sizeof(TraceRing));
+    if (r == NULL) {
+        fprintf(stderr, "Error: could not allocate a trace buffer\n");
+        exit(1);
+    }
+    atomic_init(&r->head, 0);
+    r->tid = atomic_fetch_add(&next_tid, 1);
+    r->thread_name = my_name;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+        // r->next was reloaded with the current list head, try again
+    }
+    return r;
+}
+
+// only the owning thread writes its ring. the release store publishes the event to
+// trace_write, which never reads past head
+void trace_event(const char *name, char ph) {
+    TraceRing *r = my_ring;
+    if (r == NULL) r = my_ring = new_ring();
+    unsigned long h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    TraceEvent *e = &r->events[h % TRACE_RING_EVENTS];
+    e->name = name;
+    e->ph = ph;
+    e->ts_ns = now_ns();
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+void trace_start() {
+    atomic_store(&trace_on, true);
+}
+
+void trace_stop() {
+    atomic_store(&trace_on, false);
+}
+
+// drops everything recorded so far. only call it while no thread is tracing
+void trace_reset() {
+    for (TraceRing *r = atomic_load(&rings); r != NULL; r = r->next) {
+        atomic_store(&r->head, 0);
+    }
+}
+
+// shows up as the thread's name in the viewer (call it from the thread itself)
+void trace_thread_name(const char *name) {
+    my_name = name;
+    if (my_ring != NULL) my_ring->thread_name = name;
+}
+
+// writes every thread's events as Chrome trace JSON. meant to be called after trace_stop(),
+// once the traced threads are quiet; an event still being written can be torn
+int trace_write(FILE *f) {
+    fprintf(f, "{\"traceEvents\": [\n");
+    bool first = true;
+    for (TraceRing *r = atomic_load(&rings); r != NULL; r = r->next) {
+        if (r->thread_name != NULL) {
+            fprintf(f, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", r->tid, r->thread_name);
+            first = false;
+        }
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long start = (head > TRACE_RING_EVENTS) ? head - TRACE_RING_EVENTS : 0;
+        for (unsigned long i = start; i < head; i++) {
+            const TraceEvent *e = &r->events[i % TRACE_RING_EVENTS];
+            fprintf(f, "%s  {\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+                    first ? "" : ",\n", e->name, e->ph, e->ts_ns / 1e3, r->tid);
+            first = false;
+        }
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    return ferror(f) ? -1 : 0;
+}
+
+// returns 0 on success, -1 (with a message on stderr) on failure
+int trace_export(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    int err = trace_write(f);
+    if (fclose(f) != 0 || err) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// optional timeline tracer. between trace_start() and trace_stop(), TRACE_BEGIN/TRACE_END
+// record timestamped events into a ring buffer owned by the calling thread (no locks, no
+// sharing), and trace_write() dumps every thread's events as Chrome trace JSON, which
+// chrome://tracing or ui.perfetto.dev open directly.
+// when tracing is off, each TRACE_* costs one relaxed load and a not-taken branch
+#define TRACE_RING_EVENTS (1 << 15) // per thread, the oldest events are overwritten
+
+typedef struct TraceEvent {
+    const char *name; // must be a string literal (or otherwise outlive the trace)
+    uint64_t ts_ns;
+    char ph; // 'B'egin or 'E'nd
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_EVENTS];
+    atomic_ulong head; // events ever written, only the owning thread advances it
+    int tid;
+    const char *thread_name;
+    struct TraceRing *next;
+} TraceRing;
+
+extern atomic_bool trace_on;
+
+void trace_event(const char *name, char ph);
+
+#define TRACE_BEGIN(name) do { \
+    if (__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0)) trace_event(name, 'B'); \
+} while (0)
+#define TRACE_END(name) do { \
+    if (__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0)) trace_event(name, 'E'); \
+} while (0)
+
+void trace_start();
+void trace_stop();
+void trace_reset();
+void trace_thread_name(const char *name);
+int trace_write(FILE *f);
+int trace_export(const char *path);
+
+#endif // TRACE_H